@@ -502,4 +502,119 @@ TEST_P(PREFIX_WITH_MACRO(NamingTest), n) {}
 
     assert exitcode == 0
     assert stderr == "test.cpp:1: syntax error: failed to expand 'TEST_P', Invalid ## usage when expanding 'TEST_P': Unexpected token ')'\n"
-    assert stdout == '\n'
\ No newline at end of file
+    assert stdout == '\n'
+
+def test_cachedir(record_property, tmpdir):
+    cache_dir = tmpdir / 'cache'
+    os.mkdir(cache_dir)
+
+    header_file = tmpdir / 'test.h'
+    with open(header_file, 'wt') as f:
+        f.write("int a; \\ \nint b;\n")
+
+    test_file = os.path.join(tmpdir, 'test.c')
+    with open(test_file, 'wt') as f:
+        f.write('#include "test.h"\n')
+
+    args = [f'-cachedir={cache_dir}', 'test.c']
+
+    _, stdout1, stderr1 = simplecpp(args, cwd=tmpdir)
+    record_property("stdout", stdout1)
+    record_property("stderr", stderr1)
+    assert 'int a ;' in stdout1
+    assert "portability: Combination 'backslash space newline' is not portable." in stderr1
+    assert len(os.listdir(cache_dir)) == 1
+
+    # the second run uses the cached tokens, including the lexer warning
+    _, stdout2, stderr2 = simplecpp(args, cwd=tmpdir)
+    assert stdout2 == stdout1
+    assert stderr2 == stderr1
+
+    # same size, possibly the same modification time, other contents
+    with open(header_file, 'wt') as f:
+        f.write("int c; \\ \nint d;\n")
+
+    _, stdout3, _ = simplecpp(args, cwd=tmpdir)
+    assert stdout3 == stdout1.replace('int a', 'int c').replace('int b', 'int d')
+    assert len(os.listdir(cache_dir)) == 1
+
+
+def test_load_threads(record_property, tmpdir):
+    # the headers are lexed by worker threads ahead of the include walk, also nested and repeated ones
+    os.mkdir(tmpdir / 'inc')
+    for i in range(8):
+        with open(tmpdir / 'inc' / f'h{i}.h', 'wt') as f:
+            f.write(f'#pragma once\n#include "h{(i + 1) % 8}.h"\nint h{i}; \\ \n\n')
+
+    test_file = os.path.join(tmpdir, 'test.c')
+    with open(test_file, 'wt') as f:
+        f.write(''.join(f'#include "h{i}.h"\n' for i in range(8)))
+
+    _, stdout1, stderr1 = simplecpp(['-Iinc', 'test.c'], cwd=tmpdir)
+    assert 'int h0 ;' in stdout1
+    assert "portability: Combination 'backslash space newline' is not portable." in stderr1
+
+    _, stdout2, stderr2 = simplecpp(['-j=4', '-Iinc', 'test.c'], cwd=tmpdir)
+    record_property("stdout", stdout2)
+    record_property("stderr", stderr2)
+    assert stdout2 == stdout1
+    assert stderr2 == stderr1
+
+
+@pytest.mark.parametrize("value", ['0', '4x', '-1', ' 4', '', '65', '100000', '99999999999999999999'])
+def test_load_threads_invalid(tmpdir, value):
+    test_file = os.path.join(tmpdir, 'test.c')
+    with open(test_file, 'wt'):
+        pass
+
+    exitcode, stdout, _ = simplecpp([f'-j={value}', 'test.c'], cwd=tmpdir)
+    assert exitcode == 1
+    assert stdout == f"error: option -j with invalid value '{value}', expected 1 to 64.\n"
+
+
+def test_load_threads_inactive(record_property, tmpdir):
+    # headers in inactive branches may be lexed ahead, but their warnings are dropped
+    with open(tmpdir / 'win.h', 'wt') as f:
+        f.write('int w; \\ \n\n')
+
+    test_file = os.path.join(tmpdir, 'test.c')
+    with open(test_file, 'wt') as f:
+        f.write('#ifdef _WIN32\n#include "win.h"\n#endif\nint x;\n')
+
+    _, stdout1, stderr1 = simplecpp(['test.c'], cwd=tmpdir)
+    assert stderr1 == ''
+
+    _, stdout2, stderr2 = simplecpp(['-j=2', 'test.c'], cwd=tmpdir)
+    record_property("stdout", stdout2)
+    record_property("stderr", stderr2)
+    assert stdout2 == stdout1
+    assert stderr2 == ''
+
+
+@pytest.mark.skipif(platform.system() == "Windows", reason="symbolic links need extra privileges")
+def test_incpath_dangling_symlink(record_property, tmpdir):
+    # a header is found by listing the include directories; an entry that can not be opened is skipped
+    inc1 = os.path.join(tmpdir, "inc1")
+    os.mkdir(inc1)
+    os.symlink(os.path.join(tmpdir, "missing.h"), os.path.join(inc1, "test.h"))
+
+    inc2 = os.path.join(tmpdir, "inc2")
+    os.mkdir(inc2)
+    with open(os.path.join(inc2, "test.h"), 'wt') as f:
+        f.write('found\n')
+
+    test_file = os.path.join(tmpdir, "test.c")
+    with open(test_file, 'wt') as f:
+        f.write('#include <test.h>\n'
+                '#if __has_include(<test.h>) && !__has_include(<sub/test.h>)\n'
+                'has_include\n'
+                '#endif\n')
+
+    args = ['-std=c++17', '-Iinc1', '-Iinc2', 'test.c']
+
+    _, stdout, stderr = simplecpp(args, cwd=tmpdir)
+    record_property("stdout", stdout)
+    record_property("stderr", stderr)
+
+    assert '' == stderr
+    assert '\n#line 1 "inc2/test.h"\nfound\n#line 3 "test.c"\nhas_include\n' == stdout
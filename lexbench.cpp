@@ -0,0 +1,98 @@
+/*
+ * simplecpp - A simple and high-fidelity C/C++ preprocessor library
+ * Copyright (C) 2016-2023 simplecpp team
+ */
+
+#define SIMPLECPP_TOKENLIST_ALLOW_PTR 0
+#include "simplecpp.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#ifndef _WIN32
+#  include <dirent.h>
+#endif
+
+// Lexer micro-benchmark: tokenizes the given files (or all files below the
+// given directories) from memory and reports the throughput.
+
+static void addFiles(const std::string &path, std::vector<std::string> &files)
+{
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) == -1)
+        return;
+    if ((file_stat.st_mode & S_IFMT) != S_IFDIR) {
+        files.push_back(path);
+        return;
+    }
+#ifndef _WIN32
+    DIR * const dir = opendir(path.c_str());
+    if (!dir)
+        return;
+    while (const struct dirent * const entry = readdir(dir)) {
+        if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+            continue;
+        addFiles(path + '/' + entry->d_name, files);
+    }
+    closedir(dir);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 10;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "-n=", 3) == 0)
+            iterations = std::atoi(argv[i] + 3);
+        else
+            paths.emplace_back(argv[i]);
+    }
+
+    if (paths.empty() || iterations <= 0) {
+        std::cout << "Syntax:" << std::endl;
+        std::cout << "lexbench [-n=N] path..." << std::endl;
+        std::cout << "  -n=N            Number of iterations (default 10)." << std::endl;
+        std::cout << "  path            File or directory to tokenize." << std::endl;
+        return 0;
+    }
+
+    std::vector<std::string> filenames;
+    for (const std::string &path : paths)
+        addFiles(path, filenames);
+
+    std::vector<std::string> contents;
+    std::size_t bytes = 0;
+    for (const std::string &filename : filenames) {
+        std::ifstream f(filename, std::ios::binary);
+        std::ostringstream oss;
+        oss << f.rdbuf();
+        contents.push_back(oss.str());
+        bytes += contents.back().size();
+    }
+
+    std::size_t tokens = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        for (std::size_t j = 0; j < contents.size(); j++) {
+            std::vector<std::string> files;
+            simplecpp::OutputList outputList;
+            const simplecpp::TokenList tokenlist({contents[j].data(), contents[j].size()}, files, filenames[j], &outputList);
+            for (const simplecpp::Token *tok = tokenlist.cfront(); tok; tok = tok->next)
+                ++tokens;
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const double megabytes = static_cast<double>(bytes) * iterations / (1024.0 * 1024.0);
+    std::cout << filenames.size() << " files, " << bytes << " bytes, " << (tokens / iterations) << " tokens" << std::endl;
+    std::cout << elapsed.count() << " s, " << (megabytes / elapsed.count()) << " MB/s" << std::endl;
+    return 0;
+}
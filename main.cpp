@@ -6,6 +6,7 @@
 #define SIMPLECPP_TOKENLIST_ALLOW_PTR 0
 #include "simplecpp.h"
 
+#include <cctype>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -31,13 +32,17 @@ int main(int argc, char **argv)
     bool error = false;
     const char *filename = nullptr;
     enum : std::uint8_t {
+        Mmap,
         File,
         Fstream,
         Sstream,
         CharBuffer
-    } toklist_inf = File;
+    } toklist_inf = Mmap;
     bool fail_on_error = false;
     bool linenrs = false;
+    std::string cachedir;
+    unsigned int loadThreads = 0;
+    const unsigned long maxLoadThreads = 64;
 
     // Settings..
     simplecpp::DUI dui;
@@ -102,7 +107,9 @@ int main(int argc, char **argv)
                         error = true;
                         break;
                     }
-                    if (input == "file") {
+                    if (input == "mmap") {
+                        toklist_inf = Mmap;
+                    } else if (input == "file") {
                         toklist_inf = File;
                     } else if (input == "fstream") {
                         toklist_inf = Fstream;
@@ -117,6 +124,17 @@ int main(int argc, char **argv)
                     }
                 }
                 break;
+            case 'c':
+                if (std::strncmp(arg, "-cachedir=",10)==0) {
+                    found = true;
+                    cachedir = arg + 10;
+                    if (cachedir.empty()) {
+                        std::cout << "error: option -cachedir with no value." << std::endl;
+                        error = true;
+                        break;
+                    }
+                }
+                break;
             case 's':
                 if (std::strncmp(arg, "-std=",5)==0) {
                     found = true;
@@ -153,6 +171,20 @@ int main(int argc, char **argv)
                     found = true;
                 }
                 break;
+            case 'j':
+                if (std::strncmp(arg, "-j=",3)==0) {
+                    found = true;
+                    const char * const value = arg + 3;
+                    char *end = nullptr;
+                    const unsigned long threads = std::isdigit(static_cast<unsigned char>(*value)) ? std::strtoul(value, &end, 10) : 0;
+                    if (!end || *end || threads == 0 || threads > maxLoadThreads) {
+                        std::cout << "error: option -j with invalid value '" << value << "', expected 1 to " << maxLoadThreads << "." << std::endl;
+                        error = true;
+                        break;
+                    }
+                    loadThreads = static_cast<unsigned int>(threads);
+                }
+                break;
             }
             if (!found) {
                 std::cout << "error: option '" << arg << "' is unknown." << std::endl;
@@ -183,10 +215,12 @@ int main(int argc, char **argv)
         std::cout << "  -UNAME          Undefine NAME." << std::endl;
         std::cout << "  -std=STD        Specify standard." << std::endl;
         std::cout << "  -q              Quiet mode (no output)." << std::endl;
-        std::cout << "  -input=INPUT    Specify input type - file (default), fstream, sstream, buffer." << std::endl;
+        std::cout << "  -input=INPUT    Specify input type - mmap (default), file, fstream, sstream, buffer." << std::endl;
         std::cout << "  -e              Output errors only." << std::endl;
         std::cout << "  -f              Fail when errors were encountered (exitcode 1)." << std::endl;
         std::cout << "  -l              Print lines numbers." << std::endl;
+        std::cout << "  -cachedir=DIR   Keep lexed headers in DIR for later runs." << std::endl;
+        std::cout << "  -j=N            Lex the included headers with N threads while preprocessing." << std::endl;
         return 0;
     }
 
@@ -214,17 +248,23 @@ int main(int argc, char **argv)
         std::cout << "error: could not open file '" << filename << "'" << std::endl;
     }
 
+    if (!cachedir.empty() && !isDir(cachedir)) {
+        inp_missing = true;
+        std::cout << "error: could not find cache directory '" << cachedir << "'" << std::endl;
+    }
+
     if (inp_missing)
         return 1;
 
     // Perform preprocessing
     simplecpp::OutputList outputList;
     std::vector<std::string> files;
-    simplecpp::TokenList outputTokens(files);
+    simplecpp::FileIndex fileIndex(files);
+    simplecpp::TokenList outputTokens(files, &fileIndex);
     {
         simplecpp::TokenList *rawtokens;
         if (toklist_inf == Fstream) {
-            rawtokens = new simplecpp::TokenList(f,files,filename,&outputList);
+            rawtokens = new simplecpp::TokenList(f,files,filename,&outputList,&fileIndex);
         }
         else if (toklist_inf == Sstream || toklist_inf == CharBuffer) {
             std::ostringstream oss;
@@ -233,17 +273,20 @@ int main(int argc, char **argv)
             const std::string s = oss.str();
             if (toklist_inf == Sstream) {
                 std::istringstream iss(s);
-                rawtokens = new simplecpp::TokenList(iss,files,filename,&outputList);
+                rawtokens = new simplecpp::TokenList(iss,files,filename,&outputList,&fileIndex);
             }
             else {
-                rawtokens = new simplecpp::TokenList({s.data(),s.size()},files,filename,&outputList);
+                rawtokens = new simplecpp::TokenList({s.data(),s.size()},files,filename,&outputList,&fileIndex);
             }
         } else {
             f.close();
-            rawtokens = new simplecpp::TokenList(filename,files,&outputList);
+            const simplecpp::TokenList::FileInput input = (toklist_inf == File) ? simplecpp::TokenList::FileInput::Stdio : simplecpp::TokenList::FileInput::Mapped;
+            rawtokens = new simplecpp::TokenList(filename,files,&outputList,input,&fileIndex);
         }
         rawtokens->removeComments();
         simplecpp::FileDataCache filedata;
+        filedata.setPersistentDirectory(cachedir);
+        filedata.setLoadThreads(loadThreads);
         simplecpp::preprocess(outputTokens, *rawtokens, files, filedata, dui, &outputList);
         simplecpp::cleanup(filedata);
         delete rawtokens;
@@ -24,16 +24,21 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
 #include <climits>
+#include <condition_variable>
 #include <cstddef> // IWYU pragma: keep
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <istream>
 #include <limits>
@@ -44,17 +49,29 @@
 #include <stack>
 #include <stdexcept>
 #include <string>
-#ifdef SIMPLECPP_WINDOWS
-#  include <mutex>
-#endif
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#if !defined(SIMPLECPP_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#  define SIMPLECPP_SSE2
+#  include <emmintrin.h>
+#endif
+
 #ifdef _WIN32
 #  include <direct.h>
+#  ifdef SIMPLECPP_SSE2
+#    include <intrin.h>
+#  endif
 #else
+#  include <dirent.h>
+#  include <fcntl.h>
+#  include <sys/mman.h>
 #  include <sys/stat.h>
+#  include <unistd.h>
 #endif
 
 static bool isHex(const std::string &s)
@@ -79,26 +96,29 @@ static bool isCharLiteral(const std::string &s)
     return s.size() > 1 && (s[0]=='\'') && (*s.rbegin()=='\'');
 }
 
-static const simplecpp::TokenString DEFINE("define");
-static const simplecpp::TokenString UNDEF("undef");
+static const simplecpp::Atom DEFINE("define");
+static const simplecpp::Atom UNDEF("undef");
+
+static const simplecpp::Atom INCLUDE("include");
 
-static const simplecpp::TokenString INCLUDE("include");
+static const simplecpp::Atom ERROR("error");
+static const simplecpp::Atom WARNING("warning");
 
-static const simplecpp::TokenString ERROR("error");
-static const simplecpp::TokenString WARNING("warning");
+static const simplecpp::Atom IF("if");
+static const simplecpp::Atom IFDEF("ifdef");
+static const simplecpp::Atom IFNDEF("ifndef");
+static const simplecpp::Atom DEFINED("defined");
+static const simplecpp::Atom ELSE("else");
+static const simplecpp::Atom ELIF("elif");
+static const simplecpp::Atom ENDIF("endif");
 
-static const simplecpp::TokenString IF("if");
-static const simplecpp::TokenString IFDEF("ifdef");
-static const simplecpp::TokenString IFNDEF("ifndef");
-static const simplecpp::TokenString DEFINED("defined");
-static const simplecpp::TokenString ELSE("else");
-static const simplecpp::TokenString ELIF("elif");
-static const simplecpp::TokenString ENDIF("endif");
+static const simplecpp::Atom PRAGMA("pragma");
+static const simplecpp::Atom ONCE("once");
 
-static const simplecpp::TokenString PRAGMA("pragma");
-static const simplecpp::TokenString ONCE("once");
+static const simplecpp::Atom HAS_INCLUDE("__has_include");
 
-static const simplecpp::TokenString HAS_INCLUDE("__has_include");
+static const simplecpp::Atom COUNTER("__COUNTER__");
+static const simplecpp::Atom VA_ARGS("__VA_ARGS__");
 
 template<class T> static std::string toString(T t)
 {
@@ -197,6 +217,264 @@ void simplecpp::Location::adjust(const std::string &str)
     }
 }
 
+namespace {
+    /**
+     * Process wide table of interned strings. It is split in shards with
+     * their own lock so concurrent lexing rarely contends. Entries are never
+     * removed.
+     */
+    class AtomTable {
+    public:
+        const simplecpp::Atom::Entry *intern(const std::string &s, std::size_t hash) {
+            Shard &shard = shards[hash % NUM_SHARDS];
+            const std::lock_guard<std::mutex> lock(shard.mutex);
+            if (2 * (shard.count + 1) > shard.slots.size())
+                shard.grow();
+            const std::size_t mask = shard.slots.size() - 1U;
+            for (std::size_t i = (hash / NUM_SHARDS) & mask;; i = (i + 1U) & mask) {
+                const simplecpp::Atom::Entry *&slot = shard.slots[i];
+                if (!slot) {
+                    slot = new simplecpp::Atom::Entry(s, hash, true);
+                    ++shard.count;
+                    return slot;
+                }
+                if (slot->hash == hash && slot->str == s)
+                    return slot;
+            }
+        }
+
+    private:
+        static const std::size_t NUM_SHARDS = 16;
+
+        struct Shard {
+            void grow() {
+                std::vector<const simplecpp::Atom::Entry *> old(std::max<std::size_t>(256U, 2U * slots.size()), nullptr);
+                old.swap(slots);
+                const std::size_t mask = slots.size() - 1U;
+                for (const simplecpp::Atom::Entry *entry : old) {
+                    if (!entry)
+                        continue;
+                    std::size_t i = (entry->hash / NUM_SHARDS) & mask;
+                    while (slots[i])
+                        i = (i + 1U) & mask;
+                    slots[i] = entry;
+                }
+            }
+
+            std::mutex mutex;
+            std::vector<const simplecpp::Atom::Entry *> slots;
+            std::size_t count{};
+        };
+
+        Shard shards[NUM_SHARDS];
+    };
+
+    AtomTable &atomTable()
+    {
+        // never destroyed, atoms with static storage duration may outlive it
+        static AtomTable * const table = new AtomTable;
+        return *table;
+    }
+
+    /** longer strings are rarely repeated so they are not interned */
+    const std::size_t MAX_INTERNED_SIZE = 64;
+}
+
+simplecpp::Atom::Atom(const std::string &s)
+{
+    const std::size_t hash = std::hash<std::string>()(s);
+    if (s.size() <= MAX_INTERNED_SIZE)
+        mEntry = atomTable().intern(s, hash);
+    else
+        mEntry = new Entry(s, hash, false);
+}
+
+const simplecpp::Atom::Entry *simplecpp::Atom::emptyEntry()
+{
+    static const Entry * const entry = atomTable().intern(std::string(), std::hash<std::string>()(std::string()));
+    return entry;
+}
+
+#if SIMPLECPP_TOKEN_POOL
+namespace {
+    /**
+     * Free list allocator for tokens. Memory is taken from the system in
+     * slabs and recycled by each thread, so the many short lived token lists
+     * do not go through malloc for every token. Tokens may be freed by
+     * another thread than the one that allocated them, so a thread hands
+     * its free tokens to a process-wide list when it has collected many of
+     * them and when it exits, and takes tokens from there before it
+     * allocates a new slab.
+     */
+    class TokenPool {
+    public:
+        TokenPool() = default;
+        TokenPool(const TokenPool&) = delete;
+        TokenPool &operator=(const TokenPool&) = delete;
+
+        ~TokenPool() {
+            if (freeList)
+                shared().put(freeList, freeCount);
+            freeList = nullptr;
+            freeCount = 0;
+        }
+
+        void *allocate() {
+            if (!freeList)
+                refill();
+            Node * const node = freeList;
+            freeList = node->next;
+            --freeCount;
+            return node;
+        }
+
+        void deallocate(void *p) {
+            Node * const node = static_cast<Node *>(p);
+            node->next = freeList;
+            freeList = node;
+            if (++freeCount >= RETURN_SIZE) {
+                shared().put(freeList, freeCount);
+                freeList = nullptr;
+                freeCount = 0;
+            }
+        }
+
+    private:
+        union Node {
+            Node *next;
+            alignas(simplecpp::Token) unsigned char data[sizeof(simplecpp::Token)];
+        };
+
+        static const std::size_t SLAB_SIZE = 256;
+        /** free tokens a thread keeps before it hands them to the shared list */
+        static const std::size_t RETURN_SIZE = 16 * SLAB_SIZE;
+
+        /** lists of free tokens handed over by threads */
+        class Shared {
+        public:
+            void put(Node *list, std::size_t count) {
+                const std::lock_guard<std::mutex> lock(mMutex);
+                mLists.emplace_back(list, count);
+            }
+
+            /** a list and its length, nullptr if there is none */
+            std::pair<Node *, std::size_t> take() {
+                const std::lock_guard<std::mutex> lock(mMutex);
+                if (mLists.empty())
+                    return {nullptr, 0};
+                const std::pair<Node *, std::size_t> list = mLists.back();
+                mLists.pop_back();
+                return list;
+            }
+
+        private:
+            std::mutex mMutex;
+            std::vector<std::pair<Node *, std::size_t>> mLists;
+        };
+
+        static Shared &shared() {
+            // never destroyed, tokens can still be freed while threads exit
+            static Shared * const instance = new Shared;
+            return *instance;
+        }
+
+        void refill() {
+            const std::pair<Node *, std::size_t> list = shared().take();
+            if (list.first) {
+                freeList = list.first;
+                freeCount = list.second;
+                return;
+            }
+            Node * const slab = static_cast<Node *>(::operator new(SLAB_SIZE * sizeof(Node)));
+#ifdef SIMPLECPP_TOKEN_POOL_STATS
+            capacity += SLAB_SIZE;
+#endif
+            for (std::size_t i = 0; i + 1U < SLAB_SIZE; ++i)
+                slab[i].next = &slab[i + 1U];
+            slab[SLAB_SIZE - 1U].next = nullptr;
+            freeList = slab;
+            freeCount = SLAB_SIZE;
+        }
+
+        Node *freeList{};
+        std::size_t freeCount{};
+
+#ifdef SIMPLECPP_TOKEN_POOL_STATS
+    public:
+        static std::atomic<std::size_t> capacity;
+#endif
+    };
+
+#ifdef SIMPLECPP_TOKEN_POOL_STATS
+    std::atomic<std::size_t> TokenPool::capacity{0};
+#endif
+
+    thread_local TokenPool tokenPool;
+}
+
+#ifdef SIMPLECPP_TOKEN_POOL_STATS
+std::size_t simplecpp::tokenPoolCapacity()
+{
+    return TokenPool::capacity;
+}
+#endif
+
+void *simplecpp::Token::operator new(std::size_t size)
+{
+    if (size != sizeof(Token))
+        return ::operator new(size);
+    return tokenPool.allocate();
+}
+
+void simplecpp::Token::operator delete(void *p, std::size_t size)
+{
+    if (!p)
+        return;
+    if (size != sizeof(Token))
+        ::operator delete(p);
+    else
+        tokenPool.deallocate(p);
+}
+#endif // SIMPLECPP_TOKEN_POOL
+
+bool simplecpp::Token::isExpandedFrom(const Macro* m) const
+{
+    return mExpandedFrom && std::binary_search(mExpandedFrom->cbegin(), mExpandedFrom->cend(), m, std::less<const Macro*>());
+}
+
+simplecpp::Token::MacroSet simplecpp::Token::withMacro(const MacroSet &macros, const Macro *m)
+{
+    // consecutive tokens of an expansion usually get the same set, reuse the last one.
+    // the input set is kept alive so its address can not be reused for another set.
+    struct LastResult {
+        MacroSet macros;
+        const Macro *m;
+        MacroSet result;
+    };
+    static thread_local LastResult last;
+    if (last.result && last.m == m && last.macros == macros)
+        return last.result;
+
+    MacroSet ret;
+    if (!macros) {
+        ret = std::make_shared<const std::vector<const Macro*>>(1U, m);
+    } else {
+        const auto it = std::lower_bound(macros->cbegin(), macros->cend(), m, std::less<const Macro*>());
+        if (it != macros->cend() && *it == m)
+            return macros;
+        auto s = std::make_shared<std::vector<const Macro*>>();
+        s->reserve(macros->size() + 1U);
+        s->insert(s->end(), macros->cbegin(), it);
+        s->push_back(m);
+        s->insert(s->end(), it, macros->cend());
+        ret = std::move(s);
+    }
+    last.macros = macros;
+    last.m = m;
+    last.result = ret;
+    return ret;
+}
+
 bool simplecpp::Token::isOneOf(const char ops[]) const
 {
     return (op != '\0') && (std::strchr(ops, op) != nullptr);
@@ -204,12 +482,12 @@ bool simplecpp::Token::isOneOf(const char ops[]) const
 
 bool simplecpp::Token::startsWithOneOf(const char c[]) const
 {
-    return std::strchr(c, string[0]) != nullptr;
+    return std::strchr(c, str()[0]) != nullptr;
 }
 
 bool simplecpp::Token::endsWithOneOf(const char c[]) const
 {
-    return std::strchr(c, string[string.size() - 1U]) != nullptr;
+    return std::strchr(c, str()[str().size() - 1U]) != nullptr;
 }
 
 void simplecpp::Token::printAll() const
@@ -237,6 +515,26 @@ void simplecpp::Token::printOut() const
     std::cout << std::endl;
 }
 
+static bool isNameChar(unsigned char ch)
+{
+    return std::isalnum(ch) || ch == '_' || ch == '$';
+}
+
+/**
+ * Converts UTF-16 input to one byte per code unit. Non-ASCII characters are
+ * replaced with 0xff, a trailing odd byte is dropped.
+ */
+static std::string utf16ToBytes(const unsigned char *data, std::size_t size, bool bigEndian)
+{
+    std::string ret;
+    ret.reserve(size / 2U);
+    for (std::size_t i = 0; i + 1U < size; i += 2U) {
+        const int ch16 = bigEndian ? (data[i] << 8 | data[i+1]) : (data[i+1] << 8 | data[i]);
+        ret += static_cast<char>((ch16 >= 0x80) ? 0xff : ch16);
+    }
+    return ret;
+}
+
 // cppcheck-suppress noConstructor - we call init() in the inherited to initialize the private members
 class simplecpp::TokenList::Stream {
 public:
@@ -250,26 +548,11 @@ public:
     unsigned char readChar() {
         auto ch = static_cast<unsigned char>(get());
 
-        // For UTF-16 encoded files the BOM is 0xfeff/0xfffe. If the
-        // character is non-ASCII character then replace it with 0xff
-        if (isUtf16) {
-            const auto ch2 = static_cast<unsigned char>(get());
-            const int ch16 = makeUtf16Char(ch, ch2);
-            ch = static_cast<unsigned char>(((ch16 >= 0x80) ? 0xff : ch16));
-        }
-
         // Handling of newlines..
         if (ch == '\r') {
             ch = '\n';
-
-            int ch2 = get();
-            if (isUtf16) {
-                const int c2 = get();
-                ch2 = makeUtf16Char(ch2, c2);
-            }
-
-            if (ch2 != '\n')
-                ungetChar();
+            if (get() != '\n')
+                unget();
         }
 
         return ch;
@@ -278,16 +561,6 @@ public:
     unsigned char peekChar() {
         auto ch = static_cast<unsigned char>(peek());
 
-        // For UTF-16 encoded files the BOM is 0xfeff/0xfffe. If the
-        // character is non-ASCII character then replace it with 0xff
-        if (isUtf16) {
-            (void)get();
-            const auto ch2 = static_cast<unsigned char>(peek());
-            unget();
-            const int ch16 = makeUtf16Char(ch, ch2);
-            ch = static_cast<unsigned char>(((ch16 >= 0x80) ? 0xff : ch16));
-        }
-
         // Handling of newlines..
         if (ch == '\r')
             ch = '\n';
@@ -297,23 +570,33 @@ public:
 
     void ungetChar() {
         unget();
-        if (isUtf16)
-            unget();
+    }
+
+    // runs are read character by character by the lexer
+    void appendNameChars(std::string & /*s*/) {}
+    std::size_t skipBlanks() {
+        return 0;
+    }
+    void appendUntil(std::string & /*s*/, char /*c1*/, char /*c2*/) {}
+
+    bool isUtf16() const {
+        return bom == 0xfeff || bom == 0xfffe;
+    }
+
+    /** reads the remaining UTF-16 input and converts it with utf16ToBytes() */
+    std::string readUtf16() {
+        std::string data;
+        for (int ch = get(); ch != EOF; ch = get())
+            data += static_cast<char>(ch);
+        return utf16ToBytes(reinterpret_cast<const unsigned char *>(data.data()), data.size(), bom == 0xfeff);
     }
 
 protected:
     void init() {
-        // initialize since we use peek() in getAndSkipBOM()
-        isUtf16 = false;
         bom = getAndSkipBOM();
-        isUtf16 = (bom == 0xfeff || bom == 0xfffe);
     }
 
 private:
-    inline int makeUtf16Char(const unsigned char ch, const unsigned char ch2) const {
-        return (bom == 0xfeff) ? (ch<<8 | ch2) : (ch2<<8 | ch);
-    }
-
     unsigned short getAndSkipBOM() {
         const int ch1 = peek();
 
@@ -345,8 +628,6 @@ private:
     }
 
     unsigned short bom;
-protected:
-    bool isUtf16;
 };
 
 namespace {
@@ -376,38 +657,229 @@ namespace {
         std::istream &istr;
     };
 
-    class StdCharBufStream : public simplecpp::TokenList::Stream {
+    /**
+     * Scanning kernels for the lexer. Each one returns the first position in
+     * [p,end) that stops a run of uninteresting characters. With SSE2 they
+     * check 16 bytes at a time and finish the tail byte by byte.
+     */
+#ifdef SIMPLECPP_SSE2
+    inline unsigned int firstBit(unsigned int mask)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return index;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    inline __m128i inRange(__m128i v, char lo, char hi)
+    {
+        // signed compare, bytes >= 0x80 are never in range
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                             _mm_cmplt_epi8(v, _mm_set1_epi8(static_cast<char>(hi + 1))));
+    }
+#endif
+
+    /** end of a run of name characters */
+    const unsigned char *findNameEnd(const unsigned char *p, const unsigned char *end)
+    {
+#ifdef SIMPLECPP_SSE2
+        for (; end - p >= 16; p += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            __m128i name = _mm_or_si128(inRange(v, '0', '9'), inRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'));
+            name = _mm_or_si128(name, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+            name = _mm_or_si128(name, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+            const unsigned int mask = ~static_cast<unsigned int>(_mm_movemask_epi8(name)) & 0xffffU;
+            if (mask)
+                return p + firstBit(mask);
+        }
+#endif
+        while (p < end && isNameChar(*p))
+            ++p;
+        return p;
+    }
+
+    /** end of a run of whitespace and control characters other than newlines */
+    const unsigned char *findBlankEnd(const unsigned char *p, const unsigned char *end)
+    {
+#ifdef SIMPLECPP_SSE2
+        for (; end - p >= 16; p += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            const __m128i newline = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+            const __m128i blank = _mm_andnot_si128(newline, inRange(v, 0, ' '));
+            const unsigned int mask = ~static_cast<unsigned int>(_mm_movemask_epi8(blank)) & 0xffffU;
+            if (mask)
+                return p + firstBit(mask);
+        }
+#endif
+        while (p < end && *p <= ' ' && *p != '\n' && *p != '\r')
+            ++p;
+        return p;
+    }
+
+    /** first occurrence of c1, c2 or a newline */
+    const unsigned char *findCharOrNewline(const unsigned char *p, const unsigned char *end, char c1, char c2)
+    {
+#ifdef SIMPLECPP_SSE2
+        for (; end - p >= 16; p += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            const __m128i newline = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+            const __m128i found = _mm_or_si128(newline, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(c1)), _mm_cmpeq_epi8(v, _mm_set1_epi8(c2))));
+            const unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(found));
+            if (mask)
+                return p + firstBit(mask);
+        }
+#endif
+        while (p < end && *p != c1 && *p != c2 && *p != '\n' && *p != '\r')
+            ++p;
+        return p;
+    }
+
+    /**
+     * Reads a buffer that is already in memory. This provides the same
+     * interface as TokenList::Stream but without virtual calls so the lexer
+     * can be instantiated for it directly. UTF-16 input is not lexed here,
+     * when isUtf16() is set readUtf16() converts the rest of the input so
+     * it can be read by another CharBufReader.
+     */
+    class CharBufReader {
     public:
-        // cppcheck-suppress uninitDerivedMemberVar - we call Stream::init() to initialize the private members
-        StdCharBufStream(const unsigned char* str, std::size_t size)
-            : str(str)
-            , size(size)
+        CharBufReader(const unsigned char* data, std::size_t size, bool bom = true)
+            : cur(data)
+            , end(data + size)
         {
-            init();
+            if (bom)
+                skipBOM();
         }
 
-        int get() override {
-            if (pos >= size)
-                return lastStatus = EOF;
-            return str[pos++];
+        bool isUtf16() const {
+            return utf16 != UTF16::None;
         }
-        int peek() override {
-            if (pos >= size)
-                return lastStatus = EOF;
-            return str[pos];
+
+        std::string readUtf16() const {
+            return utf16ToBytes(cur, end - cur, utf16 == UTF16::BigEndian);
         }
-        void unget() override {
-            --pos;
+
+        bool good() const {
+            return !eof;
         }
-        bool good() override {
-            return lastStatus != EOF;
+
+        unsigned char readChar() {
+            unsigned char ch = get();
+
+            // Handling of newlines..
+            if (ch == '\r') {
+                ch = '\n';
+                if (get() != '\n')
+                    unget();
+            }
+
+            return ch;
+        }
+
+        unsigned char peekChar() {
+            const unsigned char ch = peek();
+
+            // Handling of newlines..
+            return (ch == '\r') ? '\n' : ch;
+        }
+
+        void ungetChar() {
+            unget();
+        }
+
+        /** appends the name characters that follow */
+        void appendNameChars(std::string &s) {
+            const unsigned char * const p = findNameEnd(cur, end);
+            s.append(reinterpret_cast<const char *>(cur), p - cur);
+            cur = p;
+        }
+
+        /** skips the whitespace (but not newlines) that follows, returns the number of skipped characters */
+        std::size_t skipBlanks() {
+            const unsigned char * const p = findBlankEnd(cur, end);
+            const std::size_t n = p - cur;
+            cur = p;
+            return n;
+        }
+
+        /** appends the characters that follow up to c1, c2 or a newline */
+        void appendUntil(std::string &s, char c1, char c2) {
+            const unsigned char * const p = findCharOrNewline(cur, end, c1, c2);
+            s.append(reinterpret_cast<const char *>(cur), p - cur);
+            cur = p;
         }
 
     private:
-        const unsigned char *str;
-        const std::size_t size;
-        std::size_t pos{};
-        int lastStatus{};
+        // EOF is returned as 0xff
+        unsigned char get() {
+            if (cur >= end) {
+                eof = true;
+                return 0xff;
+            }
+            return *cur++;
+        }
+
+        unsigned char peek() {
+            if (cur >= end) {
+                eof = true;
+                return 0xff;
+            }
+            return *cur;
+        }
+
+        void unget() {
+            --cur;
+        }
+
+        // same as Stream::getAndSkipBOM()
+        void skipBOM() {
+            if (cur >= end) {
+                eof = true;
+                return;
+            }
+
+            const unsigned char ch1 = *cur;
+
+            // The UTF-16 BOM is 0xfffe or 0xfeff.
+            if (ch1 >= 0xfe) {
+                ++cur;
+                if (cur < end && *cur >= 0xfe) {
+                    const unsigned char ch2 = *cur++;
+                    if (ch1 == 0xfe && ch2 == 0xff)
+                        utf16 = UTF16::BigEndian;
+                    else if (ch1 == 0xff && ch2 == 0xfe)
+                        utf16 = UTF16::LittleEndian;
+                    return;
+                }
+                eof = (cur >= end);
+                unget();
+                return;
+            }
+
+            // Skip UTF-8 BOM 0xefbbbf
+            if (ch1 == 0xef) {
+                ++cur;
+                if (peek() == 0xbb) {
+                    ++cur;
+                    if (peek() == 0xbf) {
+                        ++cur;
+                        return;
+                    }
+                    unget();
+                }
+                unget();
+            }
+        }
+
+        enum class UTF16 : std::uint8_t { None, BigEndian, LittleEndian };
+
+        const unsigned char *cur;
+        const unsigned char * const end;
+        bool eof{};
+        UTF16 utf16{UTF16::None};
     };
 
     class FileStream : public simplecpp::TokenList::Stream {
@@ -441,69 +913,303 @@ namespace {
         int peek() override {
             // keep lastCh intact
             const int ch = fgetc(file);
-            unget_internal(ch);
+            ungetc(ch, file);
             return ch;
         }
         void unget() override {
-            unget_internal(lastCh);
+            ungetc(lastCh, file);
         }
         bool good() override {
             return lastStatus != EOF;
         }
 
     private:
-        void unget_internal(int ch) {
-            if (isUtf16) {
-                // TODO: use ungetc() as well
-                // UTF-16 has subsequent unget() calls
-                fseek(file, -1, SEEK_CUR);
-            } else {
-                ungetc(ch, file);
-            }
-        }
-
         FILE *file;
         int lastCh{};
         int lastStatus{};
     };
-}
 
-simplecpp::TokenList::TokenList(std::vector<std::string> &filenames) : frontToken(nullptr), backToken(nullptr), files(filenames) {}
+    /**
+     * A file opened for reading. Its identity, size and modification time
+     * are queried on the open file rather than on its path, and its
+     * contents are read from it, so that loading a file opens it once.
+     */
+    class OpenedFile {
+    public:
+        explicit OpenedFile(const std::string &path) {
+#ifdef _WIN32
+            mHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (mHandle != INVALID_HANDLE_VALUE && !GetFileInformationByHandle(mHandle, &mInformation)) {
+                CloseHandle(mHandle);
+                mHandle = INVALID_HANDLE_VALUE;
+            }
+#else
+            mFd = open(path.c_str(), O_RDONLY);
+            if (mFd >= 0 && fstat(mFd, &mStatus) != 0) {
+                close(mFd);
+                mFd = -1;
+            }
+#endif
+        }
 
-simplecpp::TokenList::TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList)
-    : frontToken(nullptr), backToken(nullptr), files(filenames)
-{
-    StdIStream stream(istr);
-    readfile(stream,filename,outputList);
-}
+        OpenedFile(const OpenedFile&) = delete;
+        OpenedFile &operator=(const OpenedFile&) = delete;
 
-simplecpp::TokenList::TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, int /*unused*/)
-    : frontToken(nullptr), backToken(nullptr), files(filenames)
-{
-    StdCharBufStream stream(data, size);
-    readfile(stream,filename,outputList);
-}
+        ~OpenedFile() {
+#ifdef _WIN32
+            if (mHandle != INVALID_HANDLE_VALUE)
+                CloseHandle(mHandle);
+#else
+            if (mFd >= 0)
+                close(mFd);
+#endif
+        }
 
-simplecpp::TokenList::TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList)
-    : frontToken(nullptr), backToken(nullptr), files(filenames)
-{
-    try {
-        FileStream stream(filename, filenames);
-        readfile(stream,filename,outputList);
-    } catch (const simplecpp::Output & e) {
-        outputList->emplace_back(e);
-    }
-}
+        bool isOpen() const {
+#ifdef _WIN32
+            return mHandle != INVALID_HANDLE_VALUE;
+#else
+            return mFd >= 0;
+#endif
+        }
 
-simplecpp::TokenList::TokenList(const TokenList &other) : frontToken(nullptr), backToken(nullptr), files(other.files)
-{
-    *this = other;
-}
+        /** size and modification time, false if it is not a regular file */
+        bool stamp(std::uint64_t &size, std::uint64_t &mtime) const {
+#ifdef _WIN32
+            size = (static_cast<std::uint64_t>(mInformation.nFileSizeHigh) << 32) | mInformation.nFileSizeLow;
+            mtime = (static_cast<std::uint64_t>(mInformation.ftLastWriteTime.dwHighDateTime) << 32) | mInformation.ftLastWriteTime.dwLowDateTime;
+#else
+            if (!S_ISREG(mStatus.st_mode))
+                return false;
+            size = static_cast<std::uint64_t>(mStatus.st_size);
+            mtime = static_cast<std::uint64_t>(mStatus.st_mtime);
+#endif
+            return true;
+        }
 
-simplecpp::TokenList::TokenList(TokenList &&other) : frontToken(nullptr), backToken(nullptr), files(other.files)
-{
-    *this = std::move(other);
-}
+#ifdef _WIN32
+        HANDLE handle() const {
+            return mHandle;
+        }
+        const BY_HANDLE_FILE_INFORMATION &information() const {
+            return mInformation;
+        }
+#else
+        int descriptor() const {
+            return mFd;
+        }
+        const struct stat &status() const {
+            return mStatus;
+        }
+#endif
+
+    private:
+#ifdef _WIN32
+        HANDLE mHandle;
+        BY_HANDLE_FILE_INFORMATION mInformation;
+#else
+        int mFd;
+        struct stat mStatus;
+#endif
+    };
+
+    /**
+     * Complete contents of a file in one contiguous buffer. The file is
+     * memory mapped when possible and read into memory otherwise.
+     */
+    class FileBuffer {
+    public:
+        /**
+         * @throws simplecpp::Output thrown if file is not found
+         */
+        FileBuffer(const std::string &filename, std::vector<std::string> &files) {
+            const OpenedFile file(filename);
+            if (!file.isOpen())
+                fileNotFound(filename, files);
+            load(file);
+        }
+
+        explicit FileBuffer(const OpenedFile &file) {
+            load(file);
+        }
+
+        FileBuffer(const FileBuffer&) = delete;
+        FileBuffer &operator=(const FileBuffer&) = delete;
+
+        ~FileBuffer() {
+#ifndef _WIN32
+            if (mapped)
+                munmap(const_cast<unsigned char *>(mapped), mappedSize);
+#endif
+        }
+
+        const unsigned char *data() const {
+            return mapped ? mapped : reinterpret_cast<const unsigned char *>(contents.data());
+        }
+
+        std::size_t size() const {
+            return mapped ? mappedSize : contents.size();
+        }
+
+    private:
+        void load(const OpenedFile &file) {
+#ifndef _WIN32
+            const struct stat &statbuf = file.status();
+            if (S_ISREG(statbuf.st_mode) && statbuf.st_size > 0) {
+                void * const addr = mmap(nullptr, static_cast<std::size_t>(statbuf.st_size), PROT_READ, MAP_PRIVATE, file.descriptor(), 0);
+                if (addr != MAP_FAILED) {
+                    mapped = static_cast<const unsigned char *>(addr);
+                    mappedSize = static_cast<std::size_t>(statbuf.st_size);
+                    return;
+                }
+            }
+            char buf[65536];
+            ssize_t len;
+            while ((len = read(file.descriptor(), buf, sizeof(buf))) > 0)
+                contents.append(buf, static_cast<std::size_t>(len));
+#else
+            char buf[65536];
+            DWORD len;
+            while (ReadFile(file.handle(), buf, sizeof(buf), &len, nullptr) && len > 0)
+                contents.append(buf, len);
+#endif
+        }
+
+        static void fileNotFound(const std::string &filename, std::vector<std::string> &files) {
+            files.emplace_back(filename);
+            throw simplecpp::Output(simplecpp::Output::FILE_NOT_FOUND, {}, "File is missing: " + filename);
+        }
+
+        const unsigned char *mapped{};
+        std::size_t mappedSize{};
+        std::string contents;
+    };
+}
+
+namespace {
+    /** Appends variable length encoded values to a byte string */
+    class ByteWriter {
+    public:
+        explicit ByteWriter(std::string &out) : out(out) {}
+
+        void bytes(const char *data, std::size_t size) {
+            out.append(data, size);
+        }
+        void varint(std::uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+        void str(const std::string &s) {
+            varint(s.size());
+            out.append(s);
+        }
+
+    private:
+        std::string &out;
+    };
+
+    /** Reads values written by ByteWriter. Reading past the end clears ok. */
+    class ByteReader {
+    public:
+        ByteReader(const unsigned char *data, std::size_t size) : pos(data), end(data + size) {}
+
+        bool bytes(const char *expected, std::size_t size) {
+            if (static_cast<std::size_t>(end - pos) < size || std::memcmp(pos, expected, size) != 0)
+                return ok = false;
+            pos += size;
+            return true;
+        }
+        std::uint64_t varint() {
+            std::uint64_t value = 0;
+            for (unsigned int shift = 0; shift < 64; shift += 7) {
+                if (pos == end)
+                    break;
+                const unsigned char c = *pos++;
+                value |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+                if ((c & 0x80) == 0)
+                    return value;
+            }
+            ok = false;
+            return 0;
+        }
+        std::string str() {
+            const std::uint64_t size = varint();
+            if (size > static_cast<std::uint64_t>(end - pos)) {
+                ok = false;
+                return std::string();
+            }
+            const char * const s = reinterpret_cast<const char *>(pos);
+            pos += size;
+            return std::string(s, static_cast<std::size_t>(size));
+        }
+        bool atEnd() const {
+            return pos == end;
+        }
+
+        bool ok{true};
+
+    private:
+        const unsigned char *pos;
+        const unsigned char * const end;
+    };
+
+    std::uint64_t zigzag(long long value)
+    {
+        return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+    }
+
+    long long unzigzag(std::uint64_t value)
+    {
+        return static_cast<long long>(value >> 1) ^ -static_cast<long long>(value & 1);
+    }
+
+    const char TOKENLIST_MAGIC[8] = {'s', 'c', 'p', 'p', 't', 'o', 'k', 'l'};
+    const std::uint64_t TOKENLIST_VERSION = 1;
+}
+
+simplecpp::TokenList::TokenList(std::vector<std::string> &filenames, FileIndex *filesIndex) : frontToken(nullptr), backToken(nullptr), files(filenames), filesIndex(filesIndex) {}
+
+simplecpp::TokenList::TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, FileIndex *filesIndex)
+    : frontToken(nullptr), backToken(nullptr), files(filenames), filesIndex(filesIndex)
+{
+    StdIStream stream(istr);
+    readfile(stream,filename,outputList);
+}
+
+simplecpp::TokenList::TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, FileIndex *filesIndex, int /*unused*/)
+    : frontToken(nullptr), backToken(nullptr), files(filenames), filesIndex(filesIndex)
+{
+    readbuffer(data,size,filename,outputList);
+}
+
+simplecpp::TokenList::TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList, FileInput input, FileIndex *filesIndex)
+    : frontToken(nullptr), backToken(nullptr), files(filenames), filesIndex(filesIndex)
+{
+    try {
+        if (input == FileInput::Mapped) {
+            const FileBuffer buffer(filename, filenames);
+            readbuffer(buffer.data(),buffer.size(),filename,outputList);
+        } else {
+            FileStream stream(filename, filenames);
+            readfile(stream,filename,outputList);
+        }
+    } catch (const simplecpp::Output & e) {
+        outputList->emplace_back(e);
+    }
+}
+
+simplecpp::TokenList::TokenList(const TokenList &other) : frontToken(nullptr), backToken(nullptr), files(other.files), filesIndex(other.filesIndex)
+{
+    *this = other;
+}
+
+simplecpp::TokenList::TokenList(TokenList &&other) : frontToken(nullptr), backToken(nullptr), files(other.files), filesIndex(other.filesIndex)
+{
+    *this = std::move(other);
+}
 
 simplecpp::TokenList::~TokenList()
 {
@@ -598,9 +1304,116 @@ std::string simplecpp::TokenList::stringify(bool linenrs) const
     return ret.str();
 }
 
-static bool isNameChar(unsigned char ch)
+/*
+ * Token records, all numbers are LEB128 varints:
+ *   file table:   count, then per file 1 for the placeholder file, whose name
+ *                 is given by the reader, or 0 and the name
+ *   string pool:  count, strings
+ *   tokens:       count, then per token
+ *                   (string index << 3) | new line << 2 | new file << 1 | whitespace ahead
+ *                   [file index] [line delta (zigzag)] column
+ * The other token flags are derived from the string when the token is created.
+ */
+static void writeTokens(ByteWriter &writer, const simplecpp::TokenList &tokens, const std::string &placeholder)
 {
-    return std::isalnum(ch) || ch == '_' || ch == '$';
+    // only the files and strings that are used, in order of appearance
+    std::unordered_map<unsigned int, std::uint64_t> fileIndexes;
+    std::vector<const std::string *> files;
+    std::unordered_map<simplecpp::Atom, std::uint64_t, simplecpp::Atom::Hasher> stringIndexes;
+    std::vector<const std::string *> pool;
+    std::size_t count = 0;
+    for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next, ++count) {
+        if (fileIndexes.emplace(tok->location.fileIndex, files.size()).second)
+            files.push_back(&tokens.file(tok->location));
+        if (stringIndexes.emplace(tok->atom(), pool.size()).second)
+            pool.push_back(&tok->str());
+    }
+
+    writer.varint(files.size());
+    for (const std::string *file : files) {
+        writer.varint(*file == placeholder ? 1 : 0);
+        if (*file != placeholder)
+            writer.str(*file);
+    }
+    writer.varint(pool.size());
+    for (const std::string *s : pool)
+        writer.str(*s);
+
+    writer.varint(count);
+    std::uint64_t prevFile = ~static_cast<std::uint64_t>(0);
+    long long prevLine = 0;
+    for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next) {
+        const std::uint64_t file = fileIndexes[tok->location.fileIndex];
+        const long long line = tok->location.line;
+        const bool newFile = file != prevFile;
+        const bool newLine = newFile || line != prevLine;
+        writer.varint((stringIndexes[tok->atom()] << 3) | (newLine ? 4U : 0U) | (newFile ? 2U : 0U) | (tok->whitespaceahead ? 1U : 0U));
+        if (newFile)
+            writer.varint(file);
+        if (newLine)
+            writer.varint(zigzag(line - prevLine));
+        writer.varint(tok->location.col);
+        prevFile = file;
+        prevLine = line;
+    }
+}
+
+/** Read token records into tokens, whose locations refer to files */
+static bool readTokens(ByteReader &reader, simplecpp::TokenList &tokens, std::vector<std::string> &files, const std::string &placeholder)
+{
+    const std::uint64_t fileCount = reader.varint();
+    for (std::uint64_t i = 0; reader.ok && i < fileCount; ++i)
+        files.emplace_back(reader.varint() == 1 ? placeholder : reader.str());
+
+    std::vector<simplecpp::Atom> pool;
+    const std::uint64_t poolSize = reader.varint();
+    for (std::uint64_t i = 0; reader.ok && i < poolSize; ++i)
+        pool.emplace_back(reader.str());
+
+    const std::uint64_t tokenCount = reader.varint();
+    simplecpp::Location loc(0, 0, 0);
+    for (std::uint64_t i = 0; reader.ok && i < tokenCount; ++i) {
+        const std::uint64_t head = reader.varint();
+        if (head & 2U)
+            loc.fileIndex = static_cast<unsigned int>(reader.varint());
+        if (head & 4U)
+            loc.line = static_cast<unsigned int>(static_cast<long long>(loc.line) + unzigzag(reader.varint()));
+        loc.col = static_cast<unsigned int>(reader.varint());
+        if (!reader.ok || (head >> 3) >= pool.size() || loc.fileIndex >= files.size())
+            return false;
+        tokens.push_back(new simplecpp::Token(pool[head >> 3], loc, (head & 1U) != 0));
+    }
+    return reader.ok;
+}
+
+std::string simplecpp::TokenList::serialize() const
+{
+    std::string data;
+    ByteWriter writer(data);
+    writer.bytes(TOKENLIST_MAGIC, sizeof(TOKENLIST_MAGIC));
+    writer.varint(TOKENLIST_VERSION);
+    writeTokens(writer, *this, std::string());
+    return data;
+}
+
+bool simplecpp::TokenList::deserialize(const char *data, std::size_t size)
+{
+    ByteReader reader(reinterpret_cast<const unsigned char *>(data), size);
+    if (!reader.bytes(TOKENLIST_MAGIC, sizeof(TOKENLIST_MAGIC)) || reader.varint() != TOKENLIST_VERSION)
+        return false;
+
+    std::vector<std::string> localFiles;
+    TokenList tokens(localFiles);
+    if (!readTokens(reader, tokens, localFiles, std::string()) || !reader.atEnd())
+        return false;
+
+    std::vector<unsigned int> fileIndexes;
+    for (const std::string &file : localFiles)
+        fileIndexes.push_back(fileIndex(file));
+    for (Token *tok = tokens.front(); tok; tok = tok->next)
+        tok->location.fileIndex = fileIndexes[tok->location.fileIndex];
+    takeTokens(tokens);
+    return true;
 }
 
 static std::string escapeString(const std::string &str)
@@ -655,6 +1468,31 @@ void simplecpp::TokenList::lineDirective(unsigned int fileIndex_, unsigned int l
 static const std::string COMMENT_END("*/");
 
 void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename, OutputList *outputList)
+{
+    if (stream.isUtf16()) {
+        const std::string data = stream.readUtf16();
+        CharBufReader reader(reinterpret_cast<const unsigned char *>(data.data()), data.size(), false);
+        tokenize(reader, filename, outputList);
+        return;
+    }
+    tokenize(stream, filename, outputList);
+}
+
+void simplecpp::TokenList::readbuffer(const unsigned char *data, std::size_t size, const std::string &filename, OutputList *outputList)
+{
+    CharBufReader reader(data, size);
+    if (reader.isUtf16()) {
+        // the lexer only handles single byte input, convert UTF-16 once up front
+        const std::string bytes = reader.readUtf16();
+        CharBufReader bytesReader(reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size(), false);
+        tokenize(bytesReader, filename, outputList);
+        return;
+    }
+    tokenize(reader, filename, outputList);
+}
+
+template<class Reader>
+void simplecpp::TokenList::tokenize(Reader &stream, const std::string &filename, OutputList *outputList)
 {
     std::stack<simplecpp::Location> loc;
 
@@ -755,7 +1593,7 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
         }
 
         if (ch <= ' ') {
-            location.col++;
+            location.col += 1 + stream.skipBlanks();
             continue;
         }
 
@@ -782,6 +1620,7 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
             const bool num = !!std::isdigit(ch);
             while (stream.good() && isNameChar(ch)) {
                 currentToken += ch;
+                stream.appendNameChars(currentToken);
                 ch = stream.readChar();
                 if (num && ch=='\'' && isNameChar(stream.peekChar()))
                     ch = stream.readChar();
@@ -794,6 +1633,7 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
         else if (ch == '/' && stream.peekChar() == '/') {
             while (stream.good() && ch != '\n') {
                 currentToken += ch;
+                stream.appendUntil(currentToken, '\\', '\\');
                 ch = stream.readChar();
                 if (ch == '\\') {
                     TokenString tmp;
@@ -832,8 +1672,9 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
             ch = stream.readChar();
             while (stream.good()) {
                 currentToken += ch;
-                if (currentToken.size() >= 4U && endsWith(currentToken, COMMENT_END))
+                if (ch == '/' && currentToken.size() >= 4U && endsWith(currentToken, COMMENT_END))
                     break;
+                stream.appendUntil(currentToken, '/', '/');
                 ch = stream.readChar();
             }
             // multiline..
@@ -1146,33 +1987,43 @@ static const std::string COMPL("compl");
 static const std::string NOT("not");
 void simplecpp::TokenList::constFoldUnaryNotPosNeg(simplecpp::Token *tok)
 {
-    for (; tok && tok->op != ')'; tok = tok->next) {
+    Token *end = tok;
+    while (end && end->op != ')')
+        end = end->next;
+    if (end == tok)
+        return;
+
+    // right to left so that "! ! 1" and "- - 1" are folded completely
+    for (Token *tok2 = end ? end->previous : back(); tok2; tok2 = (tok2 == tok) ? nullptr : tok2->previous) {
         // "not" might be !
-        if (isAlternativeUnaryOp(tok, NOT))
-            tok->op = '!';
+        if (isAlternativeUnaryOp(tok2, NOT))
+            tok2->op = '!';
         // "compl" might be ~
-        else if (isAlternativeUnaryOp(tok, COMPL))
-            tok->op = '~';
-
-        if (tok->op == '!' && tok->next && tok->next->number) {
-            tok->setstr(tok->next->str() == "0" ? "1" : "0");
-            deleteToken(tok->next);
-        } else if (tok->op == '~' && tok->next && tok->next->number) {
-            tok->setstr(toString(~stringToLL(tok->next->str())));
-            deleteToken(tok->next);
+        else if (isAlternativeUnaryOp(tok2, COMPL))
+            tok2->op = '~';
+
+        if (tok2->op == '!' && tok2->next && tok2->next->number) {
+            tok2->setstr(stringToLL(tok2->next->str()) == 0 ? "1" : "0");
+            deleteToken(tok2->next);
+        } else if (tok2->op == '~' && tok2->next && tok2->next->number) {
+            tok2->setstr(toString(~stringToLL(tok2->next->str())));
+            deleteToken(tok2->next);
         } else {
-            if (tok->previous && (tok->previous->number || tok->previous->name))
+            if (tok2->previous && (tok2->previous->number || tok2->previous->name))
                 continue;
-            if (!tok->next || !tok->next->number)
+            if (!tok2->next || !tok2->next->number)
                 continue;
-            switch (tok->op) {
+            switch (tok2->op) {
             case '+':
-                tok->setstr(tok->next->str());
-                deleteToken(tok->next);
+                tok2->setstr(tok2->next->str());
+                deleteToken(tok2->next);
                 break;
             case '-':
-                tok->setstr(tok->op + tok->next->str());
-                deleteToken(tok->next);
+                if (tok2->next->str()[0] == '-')
+                    tok2->setstr(tok2->next->str().substr(1));
+                else
+                    tok2->setstr(tok2->op + tok2->next->str());
+                deleteToken(tok2->next);
                 break;
             }
         }
@@ -1262,37 +2113,41 @@ void simplecpp::TokenList::constFoldShift(Token *tok)
 static const std::string NOTEQ("not_eq");
 void simplecpp::TokenList::constFoldComparison(Token *tok)
 {
-    for (; tok && tok->op != ')'; tok = tok->next) {
-        if (isAlternativeBinaryOp(tok,NOTEQ))
-            tok->setstr("!=");
+    Token * const tok1 = tok;
+    // relational operators bind tighter than == and !=
+    for (const bool equality : {false, true}) {
+        for (tok = tok1; tok && tok->op != ')'; tok = tok->next) {
+            if (isAlternativeBinaryOp(tok,NOTEQ))
+                tok->setstr("!=");
 
-        if (!tok->startsWithOneOf("<>=!"))
-            continue;
-        if (!tok->previous || !tok->previous->number)
-            continue;
-        if (!tok->next || !tok->next->number)
-            continue;
+            if (!tok->startsWithOneOf("<>=!"))
+                continue;
+            if (!tok->previous || !tok->previous->number)
+                continue;
+            if (!tok->next || !tok->next->number)
+                continue;
 
-        int result;
-        if (tok->str() == "==")
-            result = (stringToLL(tok->previous->str()) == stringToLL(tok->next->str()));
-        else if (tok->str() == "!=")
-            result = (stringToLL(tok->previous->str()) != stringToLL(tok->next->str()));
-        else if (tok->str() == ">")
-            result = (stringToLL(tok->previous->str()) > stringToLL(tok->next->str()));
-        else if (tok->str() == ">=")
-            result = (stringToLL(tok->previous->str()) >= stringToLL(tok->next->str()));
-        else if (tok->str() == "<")
-            result = (stringToLL(tok->previous->str()) < stringToLL(tok->next->str()));
-        else if (tok->str() == "<=")
-            result = (stringToLL(tok->previous->str()) <= stringToLL(tok->next->str()));
-        else
-            continue;
+            int result;
+            if (equality && tok->str() == "==")
+                result = (stringToLL(tok->previous->str()) == stringToLL(tok->next->str()));
+            else if (equality && tok->str() == "!=")
+                result = (stringToLL(tok->previous->str()) != stringToLL(tok->next->str()));
+            else if (!equality && tok->str() == ">")
+                result = (stringToLL(tok->previous->str()) > stringToLL(tok->next->str()));
+            else if (!equality && tok->str() == ">=")
+                result = (stringToLL(tok->previous->str()) >= stringToLL(tok->next->str()));
+            else if (!equality && tok->str() == "<")
+                result = (stringToLL(tok->previous->str()) < stringToLL(tok->next->str()));
+            else if (!equality && tok->str() == "<=")
+                result = (stringToLL(tok->previous->str()) <= stringToLL(tok->next->str()));
+            else
+                continue;
 
-        tok = tok->previous;
-        tok->setstr(toString(result));
-        deleteToken(tok->next);
-        deleteToken(tok->next);
+            tok = tok->previous;
+            tok->setstr(toString(result));
+            deleteToken(tok->next);
+            deleteToken(tok->next);
+        }
     }
 }
 
@@ -1333,30 +2188,34 @@ void simplecpp::TokenList::constFoldBitwise(Token *tok)
 static const std::string OR("or");
 void simplecpp::TokenList::constFoldLogicalOp(Token *tok)
 {
-    for (; tok && tok->op != ')'; tok = tok->next) {
-        if (tok->name) {
-            if (isAlternativeBinaryOp(tok,AND))
-                tok->setstr("&&");
-            else if (isAlternativeBinaryOp(tok,OR))
-                tok->setstr("||");
-        }
-        if (tok->str() != "&&" && tok->str() != "||")
-            continue;
-        if (!tok->previous || !tok->previous->number)
-            continue;
-        if (!tok->next || !tok->next->number)
-            continue;
+    Token * const tok1 = tok;
+    // && binds tighter than ||
+    for (const char *op : {"&&", "||"}) {
+        for (tok = tok1; tok && tok->op != ')'; tok = tok->next) {
+            if (tok->name) {
+                if (isAlternativeBinaryOp(tok,AND))
+                    tok->setstr("&&");
+                else if (isAlternativeBinaryOp(tok,OR))
+                    tok->setstr("||");
+            }
+            if (tok->str() != op)
+                continue;
+            if (!tok->previous || !tok->previous->number)
+                continue;
+            if (!tok->next || !tok->next->number)
+                continue;
 
-        int result;
-        if (tok->str() == "||")
-            result = (stringToLL(tok->previous->str()) || stringToLL(tok->next->str()));
-        else /*if (tok->str() == "&&")*/
-            result = (stringToLL(tok->previous->str()) && stringToLL(tok->next->str()));
+            int result;
+            if (op[0] == '|')
+                result = (stringToLL(tok->previous->str()) || stringToLL(tok->next->str()));
+            else
+                result = (stringToLL(tok->previous->str()) && stringToLL(tok->next->str()));
 
-        tok = tok->previous;
-        tok->setstr(toString(result));
-        deleteToken(tok->next);
-        deleteToken(tok->next);
+            tok = tok->previous;
+            tok->setstr(toString(result));
+            deleteToken(tok->next);
+            deleteToken(tok->next);
+        }
     }
 }
 
@@ -1379,6 +2238,9 @@ void simplecpp::TokenList::constFoldQuestionOp(Token *&tok1)
         Token * const falseTok = trueTok->next->next;
         if (!falseTok)
             throw std::runtime_error("invalid expression");
+        // ?: is right associative, fold a following ?: first
+        if (falseTok->next && falseTok->next->op == '?')
+            continue;
         if (condTok == tok1)
             tok1 = (condTok->str() != "0" ? trueTok : falseTok);
         deleteToken(condTok->next); // ?
@@ -1400,7 +2262,8 @@ void simplecpp::TokenList::removeComments()
     }
 }
 
-std::string simplecpp::TokenList::readUntil(Stream &stream, const Location &location, const char start, const char end, OutputList *outputList)
+template<class Reader>
+std::string simplecpp::TokenList::readUntil(Reader &stream, const Location &location, const char start, const char end, OutputList *outputList)
 {
     std::string ret;
     ret += start;
@@ -1416,6 +2279,8 @@ std::string simplecpp::TokenList::readUntil(Stream &stream, const Location &loca
         }
         backslash = false;
         ret += ch;
+        if (ch != '\\' && ch != end && ch != '\n')
+            stream.appendUntil(ret, end, '\\');
         if (ch == '\\') {
             bool update_ch = false;
             char next = 0;
@@ -1475,8 +2340,142 @@ const simplecpp::Token* simplecpp::TokenList::isLastLinePreprocessor(int maxsize
     return nullptr;
 }
 
-unsigned int simplecpp::TokenList::fileIndex(const std::string &filename)
+namespace {
+    /** file indexes with this bit set refer to the SharedFileNames table */
+    constexpr unsigned int SHARED_FILE_INDEX = 0x80000000U;
+
+    /**
+     * Process-wide table of the file names used by the tokens of concurrent
+     * FileDataCache instances. Names are only ever appended, into chunks
+     * that are never moved or freed, so returned references stay valid and
+     * name() reads them without locking; adding a name takes the mutex.
+     */
+    class SharedFileNames {
+    public:
+        unsigned int index(const std::string &name) {
+            const std::lock_guard<std::mutex> lock(mMutex);
+            const auto it = mIndexes.find(name);
+            if (it != mIndexes.end())
+                return it->second;
+            const unsigned int size = mSize.load(std::memory_order_relaxed);
+            std::size_t offset;
+            const unsigned int chunk = locate(size, offset);
+            if (offset == 0)
+                mChunks[chunk].store(new std::string[FIRST_CHUNK_SIZE << chunk], std::memory_order_relaxed);
+            mChunks[chunk].load(std::memory_order_relaxed)[offset] = name;
+            // publishes the name and its chunk to name()
+            mSize.store(size + 1, std::memory_order_release);
+            const unsigned int index = SHARED_FILE_INDEX | size;
+            mIndexes.emplace(name, index);
+            return index;
+        }
+
+        const std::string &name(unsigned int index) const {
+            const unsigned int i = index & ~SHARED_FILE_INDEX;
+            // pairs with the release in index(), the name and its chunk are visible once i is below the size
+            const unsigned int size = mSize.load(std::memory_order_acquire);
+            assert(i < size);
+            (void)size;
+            std::size_t offset;
+            const unsigned int chunk = locate(i, offset);
+            return mChunks[chunk].load(std::memory_order_relaxed)[offset];
+        }
+
+    private:
+        /** chunk c holds FIRST_CHUNK_SIZE << c names */
+        static constexpr std::size_t FIRST_CHUNK_SIZE = 64;
+
+        /** the chunk holding name i, and its offset in that chunk */
+        static unsigned int locate(unsigned int i, std::size_t &offset) {
+            std::size_t n = i / FIRST_CHUNK_SIZE + 1U;
+            unsigned int chunk = 0;
+            while (n >>= 1U)
+                ++chunk;
+            offset = i - FIRST_CHUNK_SIZE * ((static_cast<std::size_t>(1) << chunk) - 1U);
+            return chunk;
+        }
+
+        std::mutex mMutex;
+        std::unordered_map<std::string, unsigned int> mIndexes;
+        std::atomic<unsigned int> mSize{0};
+        std::atomic<std::string *> mChunks[32] = {};
+    };
+
+    SharedFileNames &sharedFileNames()
+    {
+        // never destroyed, cached tokens may outlive it
+        static SharedFileNames * const table = new SharedFileNames;
+        return *table;
+    }
+}
+
+/** Make loc, which refers to files, refer to the shared file names instead */
+static void shareLocation(simplecpp::Location &loc, const std::vector<std::string> &files)
 {
+    if (!(loc.fileIndex & SHARED_FILE_INDEX) && loc.fileIndex < files.size())
+        loc.fileIndex = sharedFileNames().index(files[loc.fileIndex]);
+}
+
+simplecpp::FileIndex::FileIndex(std::vector<std::string> &files)
+    : mFiles(files)
+{}
+
+void simplecpp::FileIndex::update()
+{
+    // a reallocated or shrunk vector may have been replaced, index it again
+    if (mFiles.data() != mData || mFiles.size() < mIndexed)
+        rebuild();
+    for (; mIndexed < mFiles.size(); ++mIndexed)
+        mIndexes.emplace(mFiles[mIndexed], static_cast<unsigned int>(mIndexed));
+}
+
+void simplecpp::FileIndex::rebuild()
+{
+    mIndexes.clear();
+    mIndexed = 0;
+    mData = mFiles.data();
+}
+
+bool simplecpp::FileIndex::indexed(const std::string &filename) const
+{
+    const auto it = mIndexes.find(filename);
+    return it != mIndexes.end() && it->second < mFiles.size() && mFiles[it->second] == filename;
+}
+
+bool simplecpp::FileIndex::find(const std::string &filename, unsigned int &index)
+{
+    update();
+    // the files were modified in place: a hit must name the same file, and
+    // on a miss the first and last indexed files must still be found
+    const bool stale = (mIndexes.find(filename) != mIndexes.end())
+                       ? !indexed(filename)
+                       : (mIndexed > 0 && (!indexed(mFiles.front()) || !indexed(mFiles[mIndexed - 1U])));
+    if (stale) {
+        rebuild();
+        update();
+    }
+    const auto it = mIndexes.find(filename);
+    if (it == mIndexes.end())
+        return false;
+    index = it->second;
+    return true;
+}
+
+unsigned int simplecpp::FileIndex::get(const std::string &filename)
+{
+    unsigned int index;
+    if (find(filename, index))
+        return index;
+    mFiles.push_back(filename);
+    update();
+    return static_cast<unsigned int>(mFiles.size() - 1U);
+}
+
+/** Index of filename in files, it is added if missing; filesIndex, if given, indexes files */
+static unsigned int fileIndexIn(std::vector<std::string> &files, const std::string &filename, simplecpp::FileIndex *filesIndex = nullptr)
+{
+    if (filesIndex)
+        return filesIndex->get(filename);
     for (unsigned int i = 0; i < files.size(); ++i) {
         if (files[i] == filename)
             return i;
@@ -1485,83 +2484,127 @@ unsigned int simplecpp::TokenList::fileIndex(const std::string &filename)
     return files.size() - 1U;
 }
 
+unsigned int simplecpp::TokenList::fileIndex(const std::string &filename)
+{
+    return fileIndexIn(files, filename, filesIndex);
+}
+
 const std::string& simplecpp::TokenList::file(const Location& loc) const
 {
     static const std::string s_emptyFileName;
+    if (loc.fileIndex & SHARED_FILE_INDEX)
+        return sharedFileNames().name(loc.fileIndex);
     return loc.fileIndex < files.size() ? files[loc.fileIndex] : s_emptyFileName;
 }
 
 
 namespace simplecpp {
     class Macro;
-    using MacroMap = std::unordered_map<TokenString,Macro>;
+    using MacroMap = std::unordered_map<Atom,Macro,Atom::Hasher>;
 
-    class Macro {
+    /**
+     * Names of the macros that are currently being expanded. Every nested
+     * expansion adds (or hides) one name with a node that lives on the stack
+     * and refers to the enclosing state, so nothing is copied or allocated.
+     */
+    class ExpandedMacros {
     public:
-        explicit Macro(std::vector<std::string> &f) : nameTokDef(nullptr), valueToken(nullptr), endToken(nullptr), files(f), tokenListDefine(f), variadic(false), variadicOpt(false), valueDefinedInCode_(false) {}
+        ExpandedMacros() = default;
 
-        /**
-         * @throws std::runtime_error thrown on bad macro syntax
-         */
-        Macro(const Token *tok, std::vector<std::string> &f) : nameTokDef(nullptr), files(f), tokenListDefine(f), valueDefinedInCode_(true) {
+        ExpandedMacros(const ExpandedMacros *parent, const Atom &name, bool add)
+            : mParent(parent)
+            , mName(name)
+            , mAdd(add)
+            , mSize(parent->mSize)
+        {
+            if (add != parent->contains(name))
+                mSize = add ? (mSize + 1U) : (mSize - 1U);
+        }
+
+        ExpandedMacros(const ExpandedMacros &) = delete;
+        ExpandedMacros &operator=(const ExpandedMacros &) = delete;
+
+        bool contains(const Atom &name) const {
+            for (const ExpandedMacros *e = this; e->mParent; e = e->mParent) {
+                if (e->mName == name)
+                    return e->mAdd;
+            }
+            return false;
+        }
+
+        std::size_t size() const {
+            return mSize;
+        }
+
+    private:
+        const ExpandedMacros *mParent{};
+        Atom mName;
+        bool mAdd{};
+        std::size_t mSize{};
+    };
+
+    class Macro {
+    public:
+        explicit Macro(std::vector<std::string> &f) : mDef(std::make_shared<Definition>(f, false)) {}
+
+        /**
+         * @throws std::runtime_error thrown on bad macro syntax
+         */
+        Macro(const Token *tok, std::vector<std::string> &f) {
             if (sameline(tok->previousSkipComments(), tok))
                 throw std::runtime_error("bad macro syntax");
             if (tok->op != '#')
                 throw std::runtime_error("bad macro syntax");
             const Token * const hashtok = tok;
             tok = tok->next;
-            if (!tok || tok->str() != DEFINE)
+            if (!tok || tok->atom() != DEFINE)
                 throw std::runtime_error("bad macro syntax");
             tok = tok->next;
             if (!tok || !tok->name || !sameline(hashtok,tok))
                 throw std::runtime_error("bad macro syntax");
-            if (!parseDefine(tok))
+            const std::shared_ptr<Definition> def = std::make_shared<Definition>(f, true);
+            if (!def->parseDefine(tok))
                 throw std::runtime_error("bad macro syntax");
+            mDef = def;
         }
 
         /**
          * @throws std::runtime_error thrown on bad macro syntax
          */
-        Macro(const std::string &name, const std::string &value, std::vector<std::string> &f) : nameTokDef(nullptr), files(f), tokenListDefine(f), valueDefinedInCode_(false) {
-            const std::string def(name + ' ' + value);
-            StdCharBufStream stream(reinterpret_cast<const unsigned char*>(def.data()), def.size());
-            tokenListDefine.readfile(stream);
-            if (!parseDefine(tokenListDefine.cfront()))
+        Macro(const std::string &name, const std::string &value, std::vector<std::string> &f) {
+            const std::shared_ptr<Definition> def = std::make_shared<Definition>(f, false);
+            const std::string s(name + ' ' + value);
+            def->tokenListDefine = TokenList({s.data(), s.size()}, f, std::string());
+            if (!def->parseDefine(def->tokenListDefine.cfront()))
                 throw std::runtime_error("bad macro syntax. macroname=" + name + " value=" + value);
+            mDef = def;
         }
 
-        Macro(const Macro &other) : nameTokDef(nullptr), files(other.files), tokenListDefine(other.files), valueDefinedInCode_(other.valueDefinedInCode_) {
-            // TODO: remove the try-catch - see #537
-            // avoid bugprone-exception-escape clang-tidy warning
-            try {
-                *this = other;
+        /**
+         * Copy of other that owns its definition, so it does not refer to the
+         * tokens other was defined by. Its locations refer to the shared file
+         * names, the usage locations of other refer to usageFiles.
+         */
+        Macro(const Macro &other, std::vector<std::string> &f, const std::vector<std::string> &usageFiles) {
+            const std::shared_ptr<Definition> def = std::make_shared<Definition>(f, other.mDef->valueDefinedInCode);
+            for (const Token *tok = other.mDef->nameTokDef; sameline(tok, other.mDef->nameTokDef); tok = tok->next) {
+                Token * const copy = new Token(*tok);
+                shareLocation(copy->location, other.mDef->files);
+                def->tokenListDefine.push_back(copy);
             }
-            catch (const Error&) {} // NOLINT(bugprone-empty-catch)
-        }
-
-        ~Macro() {
-            delete optExpandValue;
-            delete optNoExpandValue;
+            def->parseDefine(def->tokenListDefine.cfront());
+            mDef = def;
+            usageList = other.usageList;
+            for (Location &loc : usageList)
+                shareLocation(loc, usageFiles);
         }
 
-        Macro &operator=(const Macro &other) {
-            if (this != &other) {
-                files = other.files;
-                valueDefinedInCode_ = other.valueDefinedInCode_;
-                if (other.tokenListDefine.empty()) {
-                    parseDefine(other.nameTokDef);
-                }
-                else {
-                    tokenListDefine = other.tokenListDefine;
-                    parseDefine(tokenListDefine.cfront());
-                }
-                usageList = other.usageList;
-            }
-            return *this;
-        }
+        // copies share the parsed definition
+        Macro(const Macro &other) = default;
+        Macro &operator=(const Macro &other) = default;
 
         bool valueDefinedInCode() const {
-            return valueDefinedInCode_;
+            return mDef->valueDefinedInCode;
         }
 
         /**
@@ -1579,7 +2622,9 @@ namespace simplecpp {
                              const Token * rawtok,
                              const MacroMap &macros,
                              std::vector<std::string> &inputFiles) const {
-            std::set<TokenString> expandedmacros;
+            const ExpandedMacros noExpandedMacros;
+            const ExpandedMacros expandedThis(&noExpandedMacros, nameAtom(), true);
+            const ExpandedMacros *expandedmacros = &noExpandedMacros;
 
 #ifdef SIMPLECPP_DEBUG_MACRO_EXPANSION
             std::cout << "expand " << name() << " " << locstring(rawtok->location) << std::endl;
@@ -1591,9 +2636,9 @@ namespace simplecpp {
                 // Copy macro call to a new tokenlist with no linebreaks
                 const Token * const rawtok1 = rawtok;
                 TokenList rawtokens2(inputFiles);
-                rawtokens2.push_back(new Token(rawtok->str(), rawtok1->location, rawtok->whitespaceahead));
+                rawtokens2.push_back(new Token(rawtok->atom(), rawtok1->location, rawtok->whitespaceahead));
                 rawtok = rawtok->next;
-                rawtokens2.push_back(new Token(rawtok->str(), rawtok1->location, rawtok->whitespaceahead));
+                rawtokens2.push_back(new Token(rawtok->atom(), rawtok1->location, rawtok->whitespaceahead));
                 rawtok = rawtok->next;
                 int par = 1;
                 while (rawtok && par > 0) {
@@ -1603,13 +2648,13 @@ namespace simplecpp {
                         --par;
                     else if (rawtok->op == '#' && !sameline(rawtok->previous, rawtok))
                         throw Error(rawtok->location, "it is invalid to use a preprocessor directive as macro parameter");
-                    rawtokens2.push_back(new Token(rawtok->str(), rawtok1->location, rawtok->whitespaceahead));
+                    rawtokens2.push_back(new Token(rawtok->atom(), rawtok1->location, rawtok->whitespaceahead));
                     rawtok = rawtok->next;
                 }
-                if (expand(output2, rawtok1->location, rawtokens2.cfront(), macros, expandedmacros))
+                if (expand(output2, rawtok1->location, rawtokens2.cfront(), macros, *expandedmacros))
                     rawtok = rawtok1->next;
             } else {
-                rawtok = expand(output2, rawtok->location, rawtok, macros, expandedmacros);
+                rawtok = expand(output2, rawtok->location, rawtok, macros, *expandedmacros);
             }
             while (output2.cback() && rawtok) {
                 unsigned int par = 0;
@@ -1626,7 +2671,7 @@ namespace simplecpp {
                 }
                 if (macro2tok) { // macro2tok->op == '('
                     macro2tok = macro2tok->previous;
-                    expandedmacros.insert(name());
+                    expandedmacros = &expandedThis;
                 } else if (rawtok->op == '(') {
                     macro2tok = output2.back();
                 }
@@ -1634,21 +2679,21 @@ namespace simplecpp {
                     break;
                 if (output2.cfront() != output2.cback() && macro2tok->str() == this->name())
                     break;
-                const MacroMap::const_iterator macro = macros.find(macro2tok->str());
+                const MacroMap::const_iterator macro = macros.find(macro2tok->atom());
                 if (macro == macros.end() || !macro->second.functionLike())
                     break;
                 TokenList rawtokens2(inputFiles);
                 const Location loc(macro2tok->location);
                 while (macro2tok) {
                     Token * const next = macro2tok->next;
-                    rawtokens2.push_back(new Token(macro2tok->str(), loc));
+                    rawtokens2.push_back(new Token(macro2tok->atom(), loc));
                     output2.deleteToken(macro2tok);
                     macro2tok = next;
                 }
                 par = (rawtokens2.cfront() != rawtokens2.cback()) ? 1U : 0U;
                 const Token *rawtok2 = rawtok;
                 for (; rawtok2; rawtok2 = rawtok2->next) {
-                    rawtokens2.push_back(new Token(rawtok2->str(), loc));
+                    rawtokens2.push_back(new Token(rawtok2->atom(), loc));
                     if (rawtok2->op == '(') {
                         ++par;
                     }
@@ -1660,7 +2705,7 @@ namespace simplecpp {
                 }
                 if (!rawtok2 || par != 1U)
                     break;
-                if (macro->second.expand(output2, rawtok->location, rawtokens2.cfront(), macros, expandedmacros) != nullptr)
+                if (macro->second.expand(output2, rawtok->location, rawtokens2.cfront(), macros, *expandedmacros) != nullptr)
                     break;
                 rawtok = rawtok2->next;
             }
@@ -1670,12 +2715,16 @@ namespace simplecpp {
 
         /** macro name */
         const TokenString &name() const {
-            return nameTokDef->str();
+            return mDef->nameTokDef->str();
+        }
+
+        const Atom &nameAtom() const {
+            return mDef->nameTokDef->atom();
         }
 
         /** location for macro definition */
         const Location &defineLocation() const {
-            return nameTokDef->location;
+            return mDef->nameTokDef->location;
         }
 
         /** how has this macro been used so far */
@@ -1683,12 +2732,21 @@ namespace simplecpp {
             return usageList;
         }
 
+        /** record a use that is not made through expand() */
+        void addUsage(const Location &loc) const {
+            usageList.emplace_back(loc);
+        }
+
+        /** the value if this is an object-like macro whose value is a single number, otherwise nullptr */
+        const Token *numberValue() const {
+            if (functionLike() || !mDef->valueToken || mDef->valueToken->next != mDef->endToken || !mDef->valueToken->number)
+                return nullptr;
+            return mDef->valueToken;
+        }
+
         /** is this a function like macro */
         bool functionLike() const {
-            return nameTokDef->next &&
-                   nameTokDef->next->op == '(' &&
-                   sameline(nameTokDef, nameTokDef->next) &&
-                   nameTokDef->next->location.col == nameTokDef->location.col + nameTokDef->str().size();
+            return mDef->functionLike();
         }
 
         /** base class for errors */
@@ -1731,116 +2789,20 @@ namespace simplecpp {
     private:
         /** Create new token where Token::macro is set for replaced tokens */
         Token *newMacroToken(const TokenString &str, const Location &loc, bool replaced, const Token *expandedFromToken=nullptr) const {
+            return newMacroToken(Atom(str), loc, replaced, expandedFromToken);
+        }
+
+        Token *newMacroToken(const Atom &str, const Location &loc, bool replaced, const Token *expandedFromToken=nullptr) const {
             auto *tok = new Token(str,loc);
             if (replaced)
-                tok->macro = nameTokDef->str();
+                tok->macro = mDef->nameTokDef->atom();
             if (expandedFromToken)
                 tok->setExpandedFrom(expandedFromToken, this);
             return tok;
         }
 
-        /**
-         * @throws Error thrown in case of __VA_OPT__ issues
-         */
-        bool parseDefine(const Token *nametoken) {
-            nameTokDef = nametoken;
-            variadic = false;
-            variadicOpt = false;
-            delete optExpandValue;
-            optExpandValue = nullptr;
-            delete optNoExpandValue;
-            optNoExpandValue = nullptr;
-            if (!nameTokDef) {
-                valueToken = endToken = nullptr;
-                args.clear();
-                return false;
-            }
-
-            // function like macro..
-            if (functionLike()) {
-                args.clear();
-                const Token *argtok = nameTokDef->next->next;
-                while (sameline(nametoken, argtok) && argtok->op != ')') {
-                    if (argtok->str() == "..." &&
-                        argtok->next && argtok->next->op == ')') {
-                        variadic = true;
-                        if (!argtok->previous->name)
-                            args.emplace_back("__VA_ARGS__");
-                        argtok = argtok->next; // goto ')'
-                        break;
-                    }
-                    if (argtok->op != ',')
-                        args.emplace_back(argtok->str());
-                    argtok = argtok->next;
-                }
-                if (!sameline(nametoken, argtok)) {
-                    endToken = argtok ? argtok->previous : argtok;
-                    valueToken = nullptr;
-                    return false;
-                }
-                valueToken = argtok ? argtok->next : nullptr;
-            } else {
-                args.clear();
-                valueToken = nameTokDef->next;
-            }
-
-            if (!sameline(valueToken, nameTokDef))
-                valueToken = nullptr;
-            endToken = valueToken;
-            while (sameline(endToken, nameTokDef)) {
-                if (variadic && endToken->str() == "__VA_OPT__")
-                    variadicOpt = true;
-                endToken = endToken->next;
-            }
-
-            if (variadicOpt) {
-                TokenList expandValue(files);
-                TokenList noExpandValue(files);
-                for (const Token *tok = valueToken; tok && tok != endToken;) {
-                    if (tok->str() == "__VA_OPT__") {
-                        if (!sameline(tok, tok->next) || tok->next->op != '(')
-                            throw Error(tok->location, "In definition of '" + nameTokDef->str() + "': Missing opening parenthesis for __VA_OPT__");
-                        tok = tok->next->next;
-                        int par = 1;
-                        while (tok && tok != endToken) {
-                            if (tok->op == '(')
-                                par++;
-                            else if (tok->op == ')')
-                                par--;
-                            else if (tok->str() == "__VA_OPT__")
-                                throw Error(tok->location, "In definition of '" + nameTokDef->str() + "': __VA_OPT__ cannot be nested");
-                            if (par == 0) {
-                                tok = tok->next;
-                                break;
-                            }
-                            expandValue.push_back(new Token(*tok));
-                            tok = tok->next;
-                        }
-                        if (par != 0) {
-                            const Token *const lastTok = expandValue.back() ? expandValue.back() : valueToken->next;
-                            throw Error(lastTok->location, "In definition of '" + nameTokDef->str() + "': Missing closing parenthesis for __VA_OPT__");
-                        }
-                    } else {
-                        expandValue.push_back(new Token(*tok));
-                        noExpandValue.push_back(new Token(*tok));
-                        tok = tok->next;
-                    }
-                }
-                optExpandValue = new TokenList(std::move(expandValue));
-                optNoExpandValue = new TokenList(std::move(noExpandValue));
-            }
-
-            return true;
-        }
-
-        unsigned int getArgNum(const TokenString &str) const {
-            unsigned int par = 0;
-            while (par < args.size()) {
-                if (str == args[par])
-                    return par;
-                par++;
-            }
-            return ~0U;
+        unsigned int getArgNum(const Atom &str) const {
+            return mDef->argNum(str);
         }
 
         std::vector<const Token *> getMacroParameters(const Token *nameTokInst, bool calledInDefine) const {
@@ -1860,7 +2822,7 @@ namespace simplecpp {
                         break;
                     }
                     --par;
-                } else if (par == 0U && tok->op == ',' && (!variadic || parametertokens.size() < args.size())) {
+                } else if (par == 0U && tok->op == ',' && (!mDef->variadic || parametertokens.size() < mDef->args.size())) {
                     parametertokens.emplace_back(tok);
                 }
             }
@@ -1871,7 +2833,7 @@ namespace simplecpp {
                                   const Location &rawloc,
                                   const Token * const lpar,
                                   const MacroMap &macros,
-                                  const std::set<TokenString> &expandedmacros,
+                                  const ExpandedMacros &expandedmacros,
                                   const std::vector<const Token*> &parametertokens) const {
             if (!lpar || lpar->op != '(')
                 return nullptr;
@@ -1887,7 +2849,7 @@ namespace simplecpp {
                     if (!expandArg(tokens, tok, rawloc, macros, expandedmacros, parametertokens)) {
                         tokens.push_back(new Token(*tok));
                         if (tok->macro.empty() && (par > 0 || tok->str() != "("))
-                            tokens.back()->macro = name();
+                            tokens.back()->macro = mDef->nameTokDef->atom();
                     }
 
                     if (tok->op == '(') {
@@ -1906,8 +2868,8 @@ namespace simplecpp {
             return sameline(lpar,tok) ? tok : nullptr;
         }
 
-        const Token * expand(TokenList & output, const Location &loc, const Token * const nameTokInst, const MacroMap &macros, std::set<TokenString> expandedmacros) const {
-            expandedmacros.insert(nameTokInst->str());
+        const Token * expand(TokenList & output, const Location &loc, const Token * const nameTokInst, const MacroMap &macros, const ExpandedMacros &parentExpandedMacros) const {
+            const ExpandedMacros expandedmacros(&parentExpandedMacros, nameTokInst->atom(), true);
 
 #ifdef SIMPLECPP_DEBUG_MACRO_EXPANSION
             std::cout << "  expand " << name() << " " << locstring(defineLocation()) << std::endl;
@@ -1936,23 +2898,23 @@ namespace simplecpp {
             if (functionLike()) {
                 // No arguments => not macro expansion
                 if (nameTokInst->next && nameTokInst->next->op != '(') {
-                    output.push_back(new Token(nameTokInst->str(), loc));
+                    output.push_back(new Token(nameTokInst->atom(), loc));
                     return nameTokInst->next;
                 }
 
                 // Parse macro-call
-                if (variadic) {
-                    if (parametertokens1.size() < args.size()) {
+                if (mDef->variadic) {
+                    if (parametertokens1.size() < mDef->args.size()) {
                         throw wrongNumberOfParameters(nameTokInst->location, name());
                     }
                 } else {
-                    if (parametertokens1.size() != args.size() + (args.empty() ? 2U : 1U))
+                    if (parametertokens1.size() != mDef->args.size() + (mDef->args.empty() ? 2U : 1U))
                         throw wrongNumberOfParameters(nameTokInst->location, name());
                 }
             }
 
             // If macro call uses __COUNTER__ then expand that first
-            TokenList tokensparams(files);
+            TokenList tokensparams(mDef->files);
             std::vector<const Token *> parametertokens2;
             if (!parametertokens1.empty()) {
                 bool counter = false;
@@ -1963,7 +2925,7 @@ namespace simplecpp {
                     }
                 }
 
-                const MacroMap::const_iterator m = macros.find("__COUNTER__");
+                const MacroMap::const_iterator m = macros.find(COUNTER);
 
                 if (!counter || m == macros.end()) {
                     parametertokens2.swap(parametertokens1);
@@ -1991,42 +2953,58 @@ namespace simplecpp {
 
             const Token *valueToken2;
             const Token *endToken2;
+            const std::vector<Instruction> *program;
 
-            if (variadicOpt) {
-                if (parametertokens2.size() > args.size() && parametertokens2[args.size() - 1]->next->op != ')')
-                    valueToken2 = optExpandValue->cfront();
-                else
-                    valueToken2 = optNoExpandValue->cfront();
+            if (mDef->variadicOpt) {
+                if (parametertokens2.size() > mDef->args.size() && parametertokens2[mDef->args.size() - 1]->next->op != ')') {
+                    valueToken2 = mDef->optExpandValue->cfront();
+                    program = &mDef->optExpandProgram;
+                } else {
+                    valueToken2 = mDef->optNoExpandValue->cfront();
+                    program = &mDef->optNoExpandProgram;
+                }
                 endToken2 = nullptr;
             } else {
-                valueToken2 = valueToken;
-                endToken2 = endToken;
+                valueToken2 = mDef->valueToken;
+                endToken2 = mDef->endToken;
+                program = &mDef->program;
             }
 
             // expand
+            std::size_t pc = 0;
             for (const Token *tok = valueToken2; tok != endToken2;) {
+                // skip the instructions of tokens that were consumed by a paste or a nested call
+                while (pc < program->size() && (*program)[pc].tok != tok)
+                    ++pc;
+                if (pc < program->size()) {
+                    const Instruction &instruction = (*program)[pc];
+                    switch (instruction.kind) {
+                    case Instruction::LITERAL:
+                        output.push_back(newMacroToken(tok->atom(), loc, true, tok));
+                        tok = tok->next;
+                        continue;
+                    case Instruction::NAME:
+                        tok = expandName(output, loc, tok, macros, expandedmacros, parametertokens2);
+                        continue;
+                    case Instruction::PARAM:
+                        tok = expandParam(output, loc, tok, instruction.argnr, macros, expandedmacros, parametertokens2);
+                        continue;
+                    case Instruction::STRINGIFY:
+                        stringifyArg(output, loc, instruction.argnr, expandedmacros, parametertokens2);
+                        tok = tok->next->next;
+                        continue;
+                    case Instruction::PASTE:
+                        tok = expandPaste(output, loc, tok, macros, expandedmacros, parametertokens2);
+                        continue;
+                    case Instruction::OTHER:
+                        break;
+                    }
+                }
+
                 if (tok->op != '#') {
                     // A##B => AB
                     if (sameline(tok, tok->next) && tok->next && tok->next->op == '#' && tok->next->next && tok->next->next->op == '#') {
-                        if (!sameline(tok, tok->next->next->next))
-                            throw invalidHashHash::unexpectedNewline(tok->location, name());
-                        if (variadic && tok->op == ',' && tok->next->next->next->str() == args.back()) {
-                            Token *const comma = newMacroToken(tok->str(), loc, isReplaced(expandedmacros), tok);
-                            output.push_back(comma);
-                            tok = expandToken(output, loc, tok->next->next->next, macros, expandedmacros, parametertokens2);
-                            if (output.back() == comma)
-                                output.deleteToken(comma);
-                            continue;
-                        }
-                        TokenList new_output(files);
-                        if (!expandArg(new_output, tok, parametertokens2))
-                            output.push_back(newMacroToken(tok->str(), loc, isReplaced(expandedmacros), tok));
-                        else if (new_output.empty()) // placemarker token
-                            output.push_back(newMacroToken("", loc, isReplaced(expandedmacros)));
-                        else
-                            for (const Token *tok2 = new_output.cfront(); tok2; tok2 = tok2->next)
-                                output.push_back(newMacroToken(tok2->str(), loc, isReplaced(expandedmacros), tok2));
-                        tok = tok->next;
+                        tok = expandPaste(output, loc, tok, macros, expandedmacros, parametertokens2);
                     } else {
                         tok = expandToken(output, loc, tok, macros, expandedmacros, parametertokens2);
                     }
@@ -2074,7 +3052,7 @@ namespace simplecpp {
 
             if (!functionLike()) {
                 for (Token *tok = output_end_1 ? output_end_1->next : output.front(); tok; tok = tok->next) {
-                    tok->macro = nameTokInst->str();
+                    tok->macro = nameTokInst->atom();
                 }
             }
 
@@ -2084,7 +3062,33 @@ namespace simplecpp {
             return functionLike() ? parametertokens2.back()->next : nameTokInst->next;
         }
 
-        const Token *recursiveExpandToken(TokenList &output, TokenList &temp, const Location &loc, const Token *tok, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+        /**
+         * Expand A##B in the replacement list, where A is not a #
+         * @return token after B
+         */
+        const Token *expandPaste(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+            if (!sameline(tok, tok->next->next->next))
+                throw invalidHashHash::unexpectedNewline(tok->location, name());
+            if (mDef->variadic && tok->op == ',' && tok->next->next->next->atom() == mDef->args.back()) {
+                Token *const comma = newMacroToken(tok->atom(), loc, isReplaced(expandedmacros), tok);
+                output.push_back(comma);
+                tok = expandToken(output, loc, tok->next->next->next, macros, expandedmacros, parametertokens);
+                if (output.back() == comma)
+                    output.deleteToken(comma);
+                return tok;
+            }
+            TokenList new_output(mDef->files);
+            if (!expandArg(new_output, tok, parametertokens))
+                output.push_back(newMacroToken(tok->atom(), loc, isReplaced(expandedmacros), tok));
+            else if (new_output.empty()) // placemarker token
+                output.push_back(newMacroToken("", loc, isReplaced(expandedmacros)));
+            else
+                for (const Token *tok2 = new_output.cfront(); tok2; tok2 = tok2->next)
+                    output.push_back(newMacroToken(tok2->atom(), loc, isReplaced(expandedmacros), tok2));
+            return tok->next;
+        }
+
+        const Token *recursiveExpandToken(TokenList &output, TokenList &temp, const Location &loc, const Token *tok, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             if (!temp.cback() || !temp.cback()->name || !tok->next || tok->next->op != '(') {
                 output.takeTokens(temp);
                 return tok->next;
@@ -2095,8 +3099,8 @@ namespace simplecpp {
                 return tok->next;
             }
 
-            const MacroMap::const_iterator it = macros.find(temp.cback()->str());
-            if (it == macros.end() || expandedmacros.find(temp.cback()->str()) != expandedmacros.end()) {
+            const MacroMap::const_iterator it = macros.find(temp.cback()->atom());
+            if (it == macros.end() || expandedmacros.contains(temp.cback()->atom())) {
                 output.takeTokens(temp);
                 return tok->next;
             }
@@ -2107,7 +3111,7 @@ namespace simplecpp {
                 return tok->next;
             }
 
-            TokenList temp2(files);
+            TokenList temp2(mDef->files);
             temp2.push_back(new Token(temp.cback()->str(), tok->location));
 
             const Token * const tok2 = appendTokens(temp2, loc, tok->next, macros, expandedmacros, parametertokens);
@@ -2119,41 +3123,48 @@ namespace simplecpp {
             return tok2->next;
         }
 
-        const Token *expandToken(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+        const Token *expandToken(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             // Not name..
             if (!tok->name) {
-                output.push_back(newMacroToken(tok->str(), loc, true, tok));
+                output.push_back(newMacroToken(tok->atom(), loc, true, tok));
                 return tok->next;
             }
 
             // Macro parameter..
-            {
-                TokenList temp(files);
-                if (expandArg(temp, tok, loc, macros, expandedmacros, parametertokens)) {
-                    if (tok->str() == "__VA_ARGS__" && temp.empty() && output.cback() && output.cback()->str() == "," &&
-                        tok->nextSkipComments() && tok->nextSkipComments()->str() == ")")
-                        output.deleteToken(output.back());
-                    return recursiveExpandToken(output, temp, loc, tok, macros, expandedmacros, parametertokens);
-                }
-            }
+            const unsigned int argnr = getArgNum(tok->atom());
+            if (argnr < mDef->args.size())
+                return expandParam(output, loc, tok, argnr, macros, expandedmacros, parametertokens);
+
+            return expandName(output, loc, tok, macros, expandedmacros, parametertokens);
+        }
+
+        const Token *expandParam(TokenList &output, const Location &loc, const Token *tok, unsigned int argnr, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+            TokenList temp(mDef->files);
+            expandArg(temp, tok, argnr, loc, macros, expandedmacros, parametertokens);
+            if (tok->atom() == VA_ARGS && temp.empty() && output.cback() && output.cback()->str() == "," &&
+                tok->nextSkipComments() && tok->nextSkipComments()->str() == ")")
+                output.deleteToken(output.back());
+            return recursiveExpandToken(output, temp, loc, tok, macros, expandedmacros, parametertokens);
+        }
 
+        /** Expand a name that is not a parameter of this macro */
+        const Token *expandName(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             // Macro..
-            const MacroMap::const_iterator it = macros.find(tok->str());
-            if (it != macros.end() && expandedmacros.find(tok->str()) == expandedmacros.end()) {
-                std::set<std::string> expandedmacros2(expandedmacros);
-                expandedmacros2.insert(tok->str());
+            const MacroMap::const_iterator it = macros.find(tok->atom());
+            if (it != macros.end() && !expandedmacros.contains(tok->atom())) {
+                const ExpandedMacros expandedmacros2(&expandedmacros, tok->atom(), true);
 
                 const Macro &calledMacro = it->second;
                 if (!calledMacro.functionLike()) {
-                    TokenList temp(files);
+                    TokenList temp(mDef->files);
                     calledMacro.expand(temp, loc, tok, macros, expandedmacros);
                     return recursiveExpandToken(output, temp, loc, tok, macros, expandedmacros2, parametertokens);
                 }
                 if (!sameline(tok, tok->next)) {
-                    output.push_back(newMacroToken(tok->str(), loc, true, tok));
+                    output.push_back(newMacroToken(tok->atom(), loc, true, tok));
                     return tok->next;
                 }
-                TokenList tokens(files);
+                TokenList tokens(mDef->files);
                 tokens.push_back(new Token(*tok));
                 const Token * tok2 = nullptr;
                 if (tok->next->op == '(') {
@@ -2165,15 +3176,15 @@ namespace simplecpp {
                         tok2 = tok->next;
                 }
                 if (!tok2) {
-                    output.push_back(newMacroToken(tok->str(), loc, true, tok));
+                    output.push_back(newMacroToken(tok->atom(), loc, true, tok));
                     return tok->next;
                 }
-                TokenList temp(files);
+                TokenList temp(mDef->files);
                 calledMacro.expand(temp, loc, tokens.cfront(), macros, expandedmacros);
                 return recursiveExpandToken(output, temp, loc, tok2, macros, expandedmacros, parametertokens);
             }
 
-            if (tok->str() == DEFINED) {
+            if (tok->atom() == DEFINED) {
                 const Token * const tok2 = tok->next;
                 const Token * const tok3 = tok2 ? tok2->next : nullptr;
                 const Token * const tok4 = tok3 ? tok3->next : nullptr;
@@ -2188,7 +3199,7 @@ namespace simplecpp {
                 if (defToken) {
                     std::string macroName = defToken->str();
                     if (defToken->next && defToken->next->op == '#' && defToken->next->next && defToken->next->next->op == '#' && defToken->next->next->next && defToken->next->next->next->name && sameline(defToken,defToken->next->next->next)) {
-                        TokenList temp(files);
+                        TokenList temp(mDef->files);
                         if (expandArg(temp, defToken, parametertokens))
                             macroName = temp.cback()->str();
                         if (expandArg(temp, defToken->next->next->next, parametertokens))
@@ -2197,13 +3208,13 @@ namespace simplecpp {
                             macroName += defToken->next->next->next->str();
                         lastToken = defToken->next->next->next;
                     }
-                    const bool def = (macros.find(macroName) != macros.end());
+                    const bool def = (macros.find(Atom(macroName)) != macros.end());
                     output.push_back(newMacroToken(def ? "1" : "0", loc, true));
                     return lastToken->next;
                 }
             }
 
-            output.push_back(newMacroToken(tok->str(), loc, true, tok));
+            output.push_back(newMacroToken(tok->atom(), loc, true, tok));
             if (it != macros.end())
                 output.back()->markExpandedFrom(&it->second);
             return tok->next;
@@ -2213,12 +3224,12 @@ namespace simplecpp {
             if (!tok->name)
                 return false;
 
-            const unsigned int argnr = getArgNum(tok->str());
-            if (argnr >= args.size())
+            const unsigned int argnr = getArgNum(tok->atom());
+            if (argnr >= mDef->args.size())
                 return false;
 
             // empty variadic parameter
-            if (variadic && argnr + 1U >= parametertokens.size())
+            if (mDef->variadic && argnr + 1U >= parametertokens.size())
                 return true;
 
             for (const Token *partok = parametertokens[argnr]->next; partok != parametertokens[argnr + 1U]; partok = partok->next)
@@ -2227,29 +3238,32 @@ namespace simplecpp {
             return true;
         }
 
-        bool expandArg(TokenList &output, const Token *tok, const Location &loc, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+        bool expandArg(TokenList &output, const Token *tok, const Location &loc, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             if (!tok->name)
                 return false;
-            const unsigned int argnr = getArgNum(tok->str());
-            if (argnr >= args.size())
+            const unsigned int argnr = getArgNum(tok->atom());
+            if (argnr >= mDef->args.size())
                 return false;
-            if (variadic && argnr + 1U >= parametertokens.size()) // empty variadic parameter
-                return true;
+            expandArg(output, tok, argnr, loc, macros, expandedmacros, parametertokens);
+            return true;
+        }
+
+        void expandArg(TokenList &output, const Token *tok, unsigned int argnr, const Location &loc, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+            if (mDef->variadic && argnr + 1U >= parametertokens.size()) // empty variadic parameter
+                return;
             for (const Token *partok = parametertokens[argnr]->next; partok != parametertokens[argnr + 1U];) {
-                const MacroMap::const_iterator it = macros.find(partok->str());
-                if (it != macros.end() && !partok->isExpandedFrom(&it->second) && (partok->str() == name() || expandedmacros.find(partok->str()) == expandedmacros.end())) {
-                    std::set<TokenString> expandedmacros2(expandedmacros); // temporary amnesia to allow reexpansion of currently expanding macros during argument evaluation
-                    expandedmacros2.erase(name());
-                    partok = it->second.expand(output, loc, partok, macros, std::move(expandedmacros2));
+                const MacroMap::const_iterator it = macros.find(partok->atom());
+                if (it != macros.end() && !partok->isExpandedFrom(&it->second) && (partok->atom() == nameAtom() || !expandedmacros.contains(partok->atom()))) {
+                    const ExpandedMacros expandedmacros2(&expandedmacros, nameAtom(), false); // temporary amnesia to allow reexpansion of currently expanding macros during argument evaluation
+                    partok = it->second.expand(output, loc, partok, macros, expandedmacros2);
                 } else {
-                    output.push_back(newMacroToken(partok->str(), loc, isReplaced(expandedmacros), partok));
+                    output.push_back(newMacroToken(partok->atom(), loc, isReplaced(expandedmacros), partok));
                     output.back()->macro = partok->macro;
                     partok = partok->next;
                 }
             }
             if (tok->whitespaceahead && output.back())
                 output.back()->whitespaceahead = true;
-            return true;
         }
 
         /**
@@ -2261,8 +3275,13 @@ namespace simplecpp {
          * @param parametertokens  parameters given when expanding this macro
          * @return token after the X
          */
-        const Token *expandHash(TokenList &output, const Location &loc, const Token *tok, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
-            TokenList tokenListHash(files);
+        const Token *expandHash(TokenList &output, const Location &loc, const Token *tok, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+            const unsigned int argnr = tok->next->name ? getArgNum(tok->next->atom()) : ~0U;
+            if (argnr < mDef->args.size()) {
+                stringifyArg(output, loc, argnr, expandedmacros, parametertokens);
+                return tok->next->next;
+            }
+            TokenList tokenListHash(mDef->files);
             const MacroMap macros2; // temporarily bypass macro expansion
             tok = expandToken(tokenListHash, loc, tok->next, macros2, expandedmacros, parametertokens);
             std::ostringstream ostr;
@@ -2278,6 +3297,21 @@ namespace simplecpp {
             return tok;
         }
 
+        /** Expand #X => "X" where X is the parameter with index argnr */
+        void stringifyArg(TokenList &output, const Location &loc, unsigned int argnr, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+            std::string str("\"");
+            if (!mDef->variadic || argnr + 1U < parametertokens.size()) {
+                const Token * const end = parametertokens[argnr + 1U];
+                for (const Token *partok = parametertokens[argnr]->next; partok != end; partok = partok->next) {
+                    str += partok->str();
+                    if (partok->next != end && partok->whitespaceahead)
+                        str += ' ';
+                }
+            }
+            str += '\"';
+            output.push_back(newMacroToken(escapeString(str), loc, isReplaced(expandedmacros)));
+        }
+
         /**
          * Expand A##B => AB
          * The A should already be expanded. Call this when you reach the first # token
@@ -2290,7 +3324,7 @@ namespace simplecpp {
          * @param expandResult     expand ## result i.e. "AB"?
          * @return token after B
          */
-        const Token *expandHashHash(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens, bool expandResult=true) const {
+        const Token *expandHashHash(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const ExpandedMacros &expandedmacros, const std::vector<const Token*> &parametertokens, bool expandResult=true) const {
             Token *A = output.back();
             if (!A)
                 throw invalidHashHash(tok->location, name(), "Missing first argument");
@@ -2313,7 +3347,7 @@ namespace simplecpp {
             if (canBeConcatenatedStringOrChar && (B->number || !B->name))
                 throw invalidHashHash::cannotCombine(tok->location, name(), A, B);
 
-            TokenList tokensB(files);
+            TokenList tokensB(mDef->files);
             const Token *nextTok = B->next;
 
             if (canBeConcatenatedStringOrChar) {
@@ -2333,7 +3367,7 @@ namespace simplecpp {
             } else {
                 std::string strAB;
 
-                const bool varargs = variadic && !args.empty() && B->str() == args[args.size()-1U];
+                const bool varargs = mDef->variadic && !mDef->args.empty() && B->atom() == mDef->args[mDef->args.size()-1U];
 
                 if (expandArg(tokensB, B, parametertokens)) {
                     if (tokensB.empty()) {
@@ -2366,25 +3400,25 @@ namespace simplecpp {
                 if (varargs && tokensB.empty() && tok->previous->str() == ",") {
                     output.deleteToken(A);
                 }
-                else if (strAB != "," && macros.find(strAB) == macros.end()) {
+                else if (strAB != "," && macros.find(Atom(strAB)) == macros.end()) {
                     A->setstr(strAB);
                     for (Token *b = tokensB.front(); b; b = b->next)
                         b->location = loc;
                     output.takeTokens(tokensB);
                 } else if (sameline(B, nextTok) && sameline(B, nextTok->next) && nextTok->op == '#' && nextTok->next->op == '#') {
-                    TokenList output2(files);
+                    TokenList output2(mDef->files);
                     output2.push_back(new Token(strAB, tok->location));
                     nextTok = expandHashHash(output2, loc, nextTok, macros, expandedmacros, parametertokens);
                     output.deleteToken(A);
                     output.takeTokens(output2);
                 } else {
                     output.deleteToken(A);
-                    TokenList tokens(files);
+                    TokenList tokens(mDef->files);
                     tokens.push_back(new Token(strAB, tok->location));
                     // for function like macros, push the (...)
                     if (tokensB.empty() && sameline(B,B->next) && B->next->op=='(') {
-                        const MacroMap::const_iterator it = macros.find(strAB);
-                        if (it != macros.end() && expandedmacros.find(strAB) == expandedmacros.end() && it->second.functionLike()) {
+                        const MacroMap::const_iterator it = macros.find(Atom(strAB));
+                        if (it != macros.end() && !expandedmacros.contains(Atom(strAB)) && it->second.functionLike()) {
                             const Token * const tok2 = appendTokens(tokens, loc, B->next, macros, expandedmacros, parametertokens);
                             if (tok2)
                                 nextTok = tok2->next;
@@ -2403,48 +3437,219 @@ namespace simplecpp {
             return nextTok;
         }
 
-        static bool isReplaced(const std::set<std::string> &expandedmacros) {
-            // return true if size > 1
-            auto it = expandedmacros.cbegin();
-            if (it == expandedmacros.cend())
-                return false;
-            ++it;
-            return (it != expandedmacros.cend());
+        static bool isReplaced(const ExpandedMacros &expandedmacros) {
+            return expandedmacros.size() > 1U;
         }
 
-        /** name token in definition */
-        const Token *nameTokDef;
+        /** One token of a compiled replacement list, and how to expand it */
+        struct Instruction {
+            enum Kind {
+                LITERAL,   ///< token that is copied as it is
+                NAME,      ///< name that is not a parameter, it may be a macro
+                PARAM,     ///< parameter argnr
+                STRINGIFY, ///< # followed by parameter argnr
+                PASTE,     ///< token followed by ##
+                OTHER      ///< any other # sequence
+            } kind;
+            unsigned int argnr;
+            const Token *tok;
+        };
 
-        /** arguments for macro */
-        std::vector<TokenString> args;
+        /**
+         * The parsed definition. It is never modified once it is parsed, so
+         * copies of a macro share it instead of parsing it again.
+         */
+        struct Definition {
+            Definition(std::vector<std::string> &f, bool inCode) : files(f), tokenListDefine(f), valueDefinedInCode(inCode) {}
 
-        /** first token in replacement string */
-        const Token *valueToken;
+            Definition(const Definition &) = delete;
+            Definition &operator=(const Definition &) = delete;
 
-        /** token after replacement string */
-        const Token *endToken;
+            ~Definition() {
+                delete optExpandValue;
+                delete optNoExpandValue;
+            }
 
-        /** files */
-        std::vector<std::string> &files;
+            bool functionLike() const {
+                return nameTokDef->next &&
+                       nameTokDef->next->op == '(' &&
+                       sameline(nameTokDef, nameTokDef->next) &&
+                       nameTokDef->next->location.col == nameTokDef->location.col + nameTokDef->str().size();
+            }
 
-        /** this is used for -D where the definition is not seen anywhere in code */
-        TokenList tokenListDefine;
+            /**
+             * @throws Error thrown in case of __VA_OPT__ issues
+             */
+            bool parseDefine(const Token *nametoken) {
+                nameTokDef = nametoken;
+                variadic = false;
+                variadicOpt = false;
+                delete optExpandValue;
+                optExpandValue = nullptr;
+                delete optNoExpandValue;
+                optNoExpandValue = nullptr;
+                program.clear();
+                optExpandProgram.clear();
+                optNoExpandProgram.clear();
+                if (!nameTokDef) {
+                    valueToken = endToken = nullptr;
+                    args.clear();
+                    return false;
+                }
 
-        /** usage of this macro */
-        mutable std::list<Location> usageList;
+                // function like macro..
+                if (functionLike()) {
+                    args.clear();
+                    const Token *argtok = nameTokDef->next->next;
+                    while (sameline(nametoken, argtok) && argtok->op != ')') {
+                        if (argtok->str() == "..." &&
+                            argtok->next && argtok->next->op == ')') {
+                            variadic = true;
+                            if (!argtok->previous->name)
+                                args.push_back(VA_ARGS);
+                            argtok = argtok->next; // goto ')'
+                            break;
+                        }
+                        if (argtok->op != ',')
+                            args.push_back(argtok->atom());
+                        argtok = argtok->next;
+                    }
+                    if (!sameline(nametoken, argtok)) {
+                        endToken = argtok ? argtok->previous : argtok;
+                        valueToken = nullptr;
+                        return false;
+                    }
+                    valueToken = argtok ? argtok->next : nullptr;
+                } else {
+                    args.clear();
+                    valueToken = nameTokDef->next;
+                }
+
+                if (!sameline(valueToken, nameTokDef))
+                    valueToken = nullptr;
+                endToken = valueToken;
+                while (sameline(endToken, nameTokDef)) {
+                    if (variadic && endToken->str() == "__VA_OPT__")
+                        variadicOpt = true;
+                    endToken = endToken->next;
+                }
+
+                if (variadicOpt) {
+                    TokenList expandValue(files);
+                    TokenList noExpandValue(files);
+                    for (const Token *tok = valueToken; tok && tok != endToken;) {
+                        if (tok->str() == "__VA_OPT__") {
+                            if (!sameline(tok, tok->next) || tok->next->op != '(')
+                                throw Error(tok->location, "In definition of '" + nameTokDef->str() + "': Missing opening parenthesis for __VA_OPT__");
+                            tok = tok->next->next;
+                            int par = 1;
+                            while (tok && tok != endToken) {
+                                if (tok->op == '(')
+                                    par++;
+                                else if (tok->op == ')')
+                                    par--;
+                                else if (tok->str() == "__VA_OPT__")
+                                    throw Error(tok->location, "In definition of '" + nameTokDef->str() + "': __VA_OPT__ cannot be nested");
+                                if (par == 0) {
+                                    tok = tok->next;
+                                    break;
+                                }
+                                expandValue.push_back(new Token(*tok));
+                                tok = tok->next;
+                            }
+                            if (par != 0) {
+                                const Token *const lastTok = expandValue.back() ? expandValue.back() : valueToken->next;
+                                throw Error(lastTok->location, "In definition of '" + nameTokDef->str() + "': Missing closing parenthesis for __VA_OPT__");
+                            }
+                        } else {
+                            expandValue.push_back(new Token(*tok));
+                            noExpandValue.push_back(new Token(*tok));
+                            tok = tok->next;
+                        }
+                    }
+                    optExpandValue = new TokenList(std::move(expandValue));
+                    optNoExpandValue = new TokenList(std::move(noExpandValue));
+                    optExpandProgram = compile(optExpandValue->cfront(), nullptr);
+                    optNoExpandProgram = compile(optNoExpandValue->cfront(), nullptr);
+                } else {
+                    program = compile(valueToken, endToken);
+                }
+
+                return true;
+            }
+
+            unsigned int argNum(const Atom &str) const {
+                for (unsigned int par = 0; par < args.size(); ++par) {
+                    if (str == args[par])
+                        return par;
+                }
+                return ~0U;
+            }
+
+            /** Classify each token of the replacement list [begin,end) once, so expansion does not have to */
+            std::vector<Instruction> compile(const Token *begin, const Token *end) const {
+                std::vector<Instruction> instructions;
+                for (const Token *tok = begin; tok != end; tok = tok->next) {
+                    Instruction instruction{Instruction::OTHER, ~0U, tok};
+                    if (tok->op != '#') {
+                        if (sameline(tok, tok->next) && tok->next && tok->next->op == '#' && tok->next->next && tok->next->next->op == '#')
+                            instruction.kind = Instruction::PASTE;
+                        else if (!tok->name)
+                            instruction.kind = Instruction::LITERAL;
+                        else if ((instruction.argnr = argNum(tok->atom())) < args.size())
+                            instruction.kind = Instruction::PARAM;
+                        else
+                            instruction.kind = Instruction::NAME;
+                    } else if (tok->next != end && tok->next->name && (instruction.argnr = argNum(tok->next->atom())) < args.size()) {
+                        // a single # before a parameter; any other # sequence is handled token by token
+                        instruction.kind = Instruction::STRINGIFY;
+                    }
+                    instructions.push_back(instruction);
+                }
+                return instructions;
+            }
+
+            /** name token in definition */
+            const Token *nameTokDef{};
+
+            /** arguments for macro */
+            std::vector<Atom> args;
+
+            /** first token in replacement string */
+            const Token *valueToken{};
 
-        /** is macro variadic? */
-        bool variadic;
+            /** token after replacement string */
+            const Token *endToken{};
 
-        /** does the macro expansion have __VA_OPT__? */
-        bool variadicOpt;
+            /** files */
+            std::vector<std::string> &files;
 
-        /** Expansion value for varadic macros with __VA_OPT__ expanded and discarded respectively */
-        const TokenList *optExpandValue{};
-        const TokenList *optNoExpandValue{};
+            /** this is used for -D where the definition is not seen anywhere in code */
+            TokenList tokenListDefine;
 
-        /** was the value of this macro actually defined in the code? */
-        bool valueDefinedInCode_;
+            /** is macro variadic? */
+            bool variadic{};
+
+            /** does the macro expansion have __VA_OPT__? */
+            bool variadicOpt{};
+
+            /** Expansion value for varadic macros with __VA_OPT__ expanded and discarded respectively */
+            const TokenList *optExpandValue{};
+            const TokenList *optNoExpandValue{};
+
+            /** Compiled replacement list, and the compiled __VA_OPT__ variants */
+            std::vector<Instruction> program;
+            std::vector<Instruction> optExpandProgram;
+            std::vector<Instruction> optNoExpandProgram;
+
+            /** was the value of this macro actually defined in the code? */
+            const bool valueDefinedInCode;
+        };
+
+        std::shared_ptr<const Definition> mDef;
+
+        /** usage of this macro */
+        mutable std::list<Location> usageList;
     };
 }
 
@@ -2651,7 +3856,7 @@ static std::string dirPath(const std::string& path, bool withTrailingSlash=true)
     return path.substr(0, lastSlash + (withTrailingSlash ? 1U : 0U));
 }
 
-static std::string openHeader(std::ifstream &f, const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader);
+static bool hasHeader(const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader);
 
 /** Evaluate __has_include(include)
  * @throws std::runtime_error thrown on missing arguments or invalid expression
@@ -2662,7 +3867,7 @@ static void simplifyHasInclude(simplecpp::TokenList &expr, const simplecpp::DUI
         return;
 
     for (simplecpp::Token *tok = expr.front(); tok; tok = tok->next) {
-        if (tok->str() != HAS_INCLUDE)
+        if (tok->atom() != HAS_INCLUDE)
             continue;
         const simplecpp::Token *tok1 = tok->next;
         if (!tok1) {
@@ -2702,9 +3907,7 @@ static void simplifyHasInclude(simplecpp::TokenList &expr, const simplecpp::DUI
         } else {
             header = tok1->str().substr(1U, tok1->str().size() - 2U);
         }
-        std::ifstream f;
-        const std::string header2 = openHeader(f,dui,sourcefile,header,systemheader);
-        tok->setstr(header2.empty() ? "0" : "1");
+        tok->setstr(hasHeader(dui, sourcefile, header, systemheader) ? "1" : "0");
 
         tok2 = tok2->next;
         while (tok->next != tok2)
@@ -2965,8 +4168,10 @@ static void simplifyNumbers(simplecpp::TokenList &expr)
     for (simplecpp::Token *tok = expr.front(); tok; tok = tok->next) {
         if (tok->str().size() == 1U)
             continue;
-        if (tok->str().compare(0,2,"0x") == 0)
+        if (isHex(tok->str()))
             tok->setstr(toString(stringToULL(tok->str())));
+        else if (isOct(tok->str()))
+            tok->setstr(toString(stringToLL(tok->str())));
         else if (!tok->number && tok->str().find('\'') != std::string::npos)
             tok->setstr(toString(simplecpp::characterLiteralToLL(tok->str())));
     }
@@ -2983,11 +4188,12 @@ static void simplifyComments(simplecpp::TokenList &expr)
 }
 
 /**
+ * Evaluate the expression by rewriting the token list until one number is left
  * @throws std::runtime_error thrown on invalid literals, missing sizeof arguments or invalid expressions,
  * missing __has_include() arguments or expressions, undefined function-like macros, invalid number literals
  * @throws std::overflow_error thrown on overflow or division by zero
  */
-static long long evaluate(simplecpp::TokenList &expr, const simplecpp::DUI &dui, const std::map<std::string, std::size_t> &sizeOfType)
+static long long evaluateConstFold(simplecpp::TokenList &expr, const simplecpp::DUI &dui, const std::map<std::string, std::size_t> &sizeOfType)
 {
     simplifyComments(expr);
     simplifySizeof(expr, sizeOfType);
@@ -2999,88 +4205,1297 @@ static long long evaluate(simplecpp::TokenList &expr, const simplecpp::DUI &dui,
     return expr.cfront() && expr.cfront() == expr.cback() && expr.cfront()->number ? stringToLL(expr.cfront()->str()) : 0LL;
 }
 
-static const simplecpp::Token *gotoNextLine(const simplecpp::Token *tok)
-{
-    const unsigned int line = tok->location.line;
-    const unsigned int file = tok->location.fileIndex;
-    while (tok && tok->location.line == line && tok->location.fileIndex == file)
-        tok = tok->next;
-    return tok;
-}
+namespace {
+    /** One step of a compiled #if expression, in postfix order */
+    struct ExpressionStep {
+        enum Kind { NUMBER, NAME, DEFINED, UNARY, BINARY, CONDITIONAL } kind;
+        /** value of a NUMBER */
+        long long value;
+        /** name of a NAME, operand of a DEFINED, operator of an UNARY or BINARY */
+        const simplecpp::Token *tok;
+    };
 
-#ifdef SIMPLECPP_WINDOWS
+    /** value of an integer literal, false if it does not fit */
+    bool integerValue(const std::string &s, long long &result)
+    {
+        unsigned int base = 10;
+        std::string::size_type pos = 0;
+        std::string::size_type maxDigits = 18;
+        if (isHex(s)) {
+            base = 16;
+            pos = 2;
+            maxDigits = 15;
+        } else if (isOct(s)) {
+            base = 8;
+            pos = 1;
+            maxDigits = 20;
+        }
+        const std::string::size_type start = pos;
+        unsigned long long value = 0;
+        for (; pos < s.size(); ++pos) {
+            const char c = s[pos];
+            unsigned int digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (base == 16 && c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (base == 16 && c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                break;
+            if (digit >= base)
+                break;
+            if (pos - start == maxDigits)
+                return false;
+            value = value * base + digit;
+        }
+        if (pos == start)
+            return false;
+        result = static_cast<long long>(value);
+        return true;
+    }
 
-class NonExistingFilesCache {
-public:
-    NonExistingFilesCache() {}
+    /**
+     * Compiles an #if expression into postfix steps (precedence climbing).
+     * It only accepts well formed expressions of numbers, character
+     * literals, names and operators. Everything else - sizeof,
+     * __has_include, alternative operator names, function-like macro calls,
+     * syntax errors - is left to evaluateConstFold(), which gives such
+     * expressions their value or error.
+     *
+     * The names of a preprocessed expression are 0. The names of a raw
+     * directive line become NAME steps, and "defined X" or "defined ( X )"
+     * a DEFINED step, that are resolved with the macros of the moment the
+     * directive is reached.
+     */
+    class ExpressionCompiler {
+    public:
+        ExpressionCompiler(const simplecpp::Token *begin, const simplecpp::Token *end, bool rawNames)
+            : mEnd(end)
+            , mRawNames(rawNames)
+        {
+            mTok = skipComments(begin);
+        }
 
-    bool contains(const std::string& path) {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        return (m_pathSet.find(path) != m_pathSet.end());
-    }
+        /** @return false if the expression can not be compiled */
+        bool compile(std::vector<ExpressionStep> &steps) {
+            mSteps = &steps;
+            try {
+                return conditional() && !mTok;
+            } catch (const std::runtime_error &) {
+                // invalid character literal
+                return false;
+            }
+        }
 
-    void add(const std::string& path) {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        m_pathSet.insert(path);
-    }
+    private:
+        const simplecpp::Token *skipComments(const simplecpp::Token *tok) const {
+            while (tok != mEnd && tok->comment)
+                tok = tok->next;
+            return (tok == mEnd) ? nullptr : tok;
+        }
 
-    void clear() {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        m_pathSet.clear();
-    }
+        void advance() {
+            mTok = skipComments(mTok->next);
+        }
+
+        void add(ExpressionStep::Kind kind, long long value, const simplecpp::Token *tok) {
+            mSteps->push_back({kind, value, tok});
+        }
+
+        bool conditional() {
+            if (!binary(1))
+                return false;
+            if (!mTok || mTok->op != '?')
+                return true;
+            advance();
+            if (!conditional() || !mTok || mTok->op != ':')
+                return false;
+            advance();
+            if (!conditional())
+                return false;
+            add(ExpressionStep::CONDITIONAL, 0, nullptr);
+            return true;
+        }
+
+        bool binary(int minPrecedence) {
+            if (!unary())
+                return false;
+            while (mTok) {
+                const int precedence = binaryPrecedence(mTok);
+                if (precedence < minPrecedence)
+                    break;
+                const simplecpp::Token * const op = mTok;
+                advance();
+                if (!binary(precedence + 1))
+                    return false;
+                add(ExpressionStep::BINARY, 0, op);
+            }
+            return true;
+        }
+
+        bool unary() {
+            if (!mTok)
+                return false;
+            const simplecpp::Token * const op = mTok;
+            switch (op->op) {
+            case '+':
+            case '-':
+            case '!':
+            case '~':
+                advance();
+                if (!unary())
+                    return false;
+                if (op->op != '+')
+                    add(ExpressionStep::UNARY, 0, op);
+                return true;
+            case '(':
+                advance();
+                if (!conditional() || !mTok || mTok->op != ')')
+                    return false;
+                advance();
+                return true;
+            default:
+                return primary();
+            }
+        }
+
+        bool primary() {
+            const simplecpp::Token * const tok = mTok;
+            if (tok->number) {
+                long long value;
+                if (!integerValue(tok->str(), value))
+                    return false;
+                add(ExpressionStep::NUMBER, value, nullptr);
+            } else if (tok->name) {
+                static const simplecpp::Atom special[] = {
+                    simplecpp::Atom("sizeof"), HAS_INCLUDE, simplecpp::Atom("and"), simplecpp::Atom("or"), simplecpp::Atom("bitand"),
+                    simplecpp::Atom("bitor"), simplecpp::Atom("compl"), simplecpp::Atom("not"), simplecpp::Atom("not_eq"), simplecpp::Atom("xor")
+                };
+                if (std::find(std::begin(special), std::end(special), tok->atom()) != std::end(special))
+                    return false;
+                if (mRawNames && tok->atom() == DEFINED)
+                    return defined();
+                const simplecpp::Token * const next = skipComments(tok->next);
+                if (next && next->op == '(')
+                    return false;
+                if (mRawNames)
+                    add(ExpressionStep::NAME, 0, tok);
+                else
+                    add(ExpressionStep::NUMBER, 0, nullptr);
+            } else if (tok->str().size() > 1U && tok->str().find('\'') != std::string::npos) {
+                add(ExpressionStep::NUMBER, simplecpp::characterLiteralToLL(tok->str()), nullptr);
+            } else {
+                return false;
+            }
+            advance();
+            return true;
+        }
+
+        /** "defined X" or "defined ( X )" */
+        bool defined() {
+            advance();
+            const bool par = (mTok && mTok->op == '(');
+            if (par)
+                advance();
+            if (!mTok || !mTok->name)
+                return false;
+            add(ExpressionStep::DEFINED, 0, mTok);
+            advance();
+            if (par) {
+                if (!mTok || mTok->op != ')')
+                    return false;
+                advance();
+            }
+            return true;
+        }
+
+        static int binaryPrecedence(const simplecpp::Token *tok) {
+            switch (tok->op) {
+            case '*':
+            case '/':
+            case '%':
+                return 10;
+            case '+':
+            case '-':
+                return 9;
+            case '<':
+            case '>':
+                return 7;
+            case '&':
+                return 5;
+            case '^':
+                return 4;
+            case '|':
+                return 3;
+            case '\0':
+                break;
+            default:
+                return 0;
+            }
+            const std::string &s = tok->str();
+            if (s.size() != 2U || tok->name)
+                return 0;
+            if (s == "<<" || s == ">>")
+                return 8;
+            if (s == "<=" || s == ">=")
+                return 7;
+            if (s == "==" || s == "!=")
+                return 6;
+            if (s == "&&")
+                return 2;
+            if (s == "||")
+                return 1;
+            return 0;
+        }
+
+        const simplecpp::Token *mTok;
+        const simplecpp::Token * const mEnd;
+        const bool mRawNames;
+        std::vector<ExpressionStep> *mSteps{};
+    };
+
+    /** lhs = lhs op rhs, false on division by zero, overflowing division and shifts out of range */
+    bool applyBinary(const simplecpp::Token *op, long long &lhs, long long rhs)
+    {
+        const unsigned long long ulhs = static_cast<unsigned long long>(lhs);
+        const unsigned long long urhs = static_cast<unsigned long long>(rhs);
+        switch (op->op) {
+        case '*':
+            lhs = static_cast<long long>(ulhs * urhs);
+            return true;
+        case '/':
+        case '%':
+            if (rhs == 0 || (rhs == -1 && lhs == std::numeric_limits<long long>::min()))
+                return false;
+            lhs = (op->op == '/') ? (lhs / rhs) : (lhs % rhs);
+            return true;
+        case '+':
+            lhs = static_cast<long long>(ulhs + urhs);
+            return true;
+        case '-':
+            lhs = static_cast<long long>(ulhs - urhs);
+            return true;
+        case '<':
+            lhs = (lhs < rhs);
+            return true;
+        case '>':
+            lhs = (lhs > rhs);
+            return true;
+        case '&':
+            lhs &= rhs;
+            return true;
+        case '^':
+            lhs ^= rhs;
+            return true;
+        case '|':
+            lhs |= rhs;
+            return true;
+        default:
+            break;
+        }
+        const std::string &s = op->str();
+        if (s == "<<" || s == ">>") {
+            if (rhs < 0 || rhs >= 64)
+                return false;
+            lhs = (s[0] == '<') ? static_cast<long long>(ulhs << rhs) : (lhs >> rhs);
+        } else if (s == "<=") {
+            lhs = (lhs <= rhs);
+        } else if (s == ">=") {
+            lhs = (lhs >= rhs);
+        } else if (s == "==") {
+            lhs = (lhs == rhs);
+        } else if (s == "!=") {
+            lhs = (lhs != rhs);
+        } else if (s == "&&") {
+            lhs = (lhs && rhs);
+        } else /*if (s == "||")*/ {
+            lhs = (lhs || rhs);
+        }
+        return true;
+    }
+
+    /**
+     * Runs compiled steps. Like evaluateConstFold() all operands are
+     * evaluated, also in the branches that ?:, && and || do not select, and
+     * arithmetic wraps.
+     * @param resolve bool(const ExpressionStep &step, long long &value) gives the value of NAME and DEFINED steps
+     * @return false if resolve fails or on division by zero, overflowing division and shifts out of range
+     */
+    template<class Resolver>
+    bool runExpression(const std::vector<ExpressionStep> &steps, const Resolver &resolve, long long &result)
+    {
+        std::vector<long long> stack;
+        stack.reserve(steps.size());
+        for (const ExpressionStep &step : steps) {
+            switch (step.kind) {
+            case ExpressionStep::NUMBER:
+                stack.push_back(step.value);
+                break;
+            case ExpressionStep::NAME:
+            case ExpressionStep::DEFINED: {
+                long long value;
+                if (!resolve(step, value))
+                    return false;
+                stack.push_back(value);
+                break;
+            }
+            case ExpressionStep::UNARY: {
+                long long &value = stack.back();
+                if (step.tok->op == '-')
+                    value = static_cast<long long>(0ULL - static_cast<unsigned long long>(value));
+                else if (step.tok->op == '!')
+                    value = (value == 0);
+                else /*if (step.tok->op == '~')*/
+                    value = ~value;
+                break;
+            }
+            case ExpressionStep::BINARY: {
+                const long long rhs = stack.back();
+                stack.pop_back();
+                if (!applyBinary(step.tok, stack.back(), rhs))
+                    return false;
+                break;
+            }
+            case ExpressionStep::CONDITIONAL: {
+                const long long falseValue = stack.back();
+                stack.pop_back();
+                const long long trueValue = stack.back();
+                stack.pop_back();
+                stack.back() = stack.back() ? trueValue : falseValue;
+                break;
+            }
+            }
+        }
+        result = stack.back();
+        return true;
+    }
+}
+
+/**
+ * @throws std::runtime_error thrown on invalid literals, missing sizeof arguments or invalid expressions,
+ * missing __has_include() arguments or expressions, undefined function-like macros, invalid number literals
+ * @throws std::overflow_error thrown on overflow or division by zero
+ */
+static long long evaluate(simplecpp::TokenList &expr, const simplecpp::DUI &dui, const std::map<std::string, std::size_t> &sizeOfType)
+{
+    std::vector<ExpressionStep> steps;
+    long long result;
+    const auto noNames = [](const ExpressionStep &, long long &) {
+        return false;
+    };
+    if (!ExpressionCompiler(expr.cfront(), nullptr, false).compile(steps) || !runExpression(steps, noNames, result))
+        return evaluateConstFold(expr, dui, sizeOfType);
+
+#ifdef SIMPLECPP_VERIFY_EVALUATE
+    // differential check against the token rewriting path
+    simplecpp::TokenList expr2(expr);
+    std::string expected;
+    try {
+        expected = toString(evaluateConstFold(expr2, dui, sizeOfType));
+    } catch (const std::exception &e) {
+        expected = std::string("exception: ") + e.what();
+    }
+    if (expected != toString(result)) {
+        std::cerr << "#if evaluation mismatch at " << expr.file(expr.cfront()->location) << ':' << expr.cfront()->location.line << ':';
+        for (const simplecpp::Token *tok = expr.cfront(); tok; tok = tok->next)
+            std::cerr << ' ' << tok->str();
+        std::cerr << " => " << result << ", constFold: " << expected << std::endl;
+        std::abort();
+    }
+#endif
+
+    return result;
+}
+
+static const simplecpp::Token *gotoNextLine(const simplecpp::Token *tok)
+{
+    const unsigned int line = tok->location.line;
+    const unsigned int file = tok->location.fileIndex;
+    while (tok && tok->location.line == line && tok->location.fileIndex == file)
+        tok = tok->next;
+    return tok;
+}
+
+/** If the file starts with "#ifndef NAME" (ignoring comments), return the NAME token */
+static const simplecpp::Token *ifndefNameToken(const simplecpp::TokenList &tokens)
+{
+    const simplecpp::Token *tok = tokens.cfront();
+    while (tok && tok->comment)
+        tok = tok->next;
+    if (!tok || tok->op != '#' || !sameline(tok, tok->next) || tok->next->atom() != IFNDEF)
+        return nullptr;
+    const simplecpp::Token * const nameToken = tok->next->next;
+    if (!nameToken || !nameToken->name || !sameline(tok, nameToken))
+        return nullptr;
+    return nameToken;
+}
+
+/**
+ * Detect the multiple-include optimization idiom: everything except comments
+ * is inside "#ifndef NAME" and its matching #endif, and that group has no
+ * #else or #elif. Any conditional in the file that would be diagnosed even
+ * while skipped disqualifies it, so skipping a guarded include is never
+ * observable.
+ */
+static simplecpp::Atom findIncludeGuard(const simplecpp::TokenList &tokens)
+{
+    const simplecpp::Token * const nameToken = ifndefNameToken(tokens);
+    if (!nameToken || nameToken->atom() == HAS_INCLUDE)
+        return {};
+
+    unsigned int depth = 0;
+    const simplecpp::Token *tok = gotoNextLine(nameToken);
+    while (tok) {
+        if (tok->op != '#' || sameline(tok->previousSkipComments(), tok)) {
+            tok = gotoNextLine(tok);
+            continue;
+        }
+        const simplecpp::Token * const directive = tok->next;
+        if (!sameline(tok, directive)) {
+            tok = directive;
+            continue;
+        }
+        if (directive->atom() == IF || directive->atom() == IFDEF || directive->atom() == IFNDEF) {
+            if (!sameline(directive, directive->next))
+                return {};
+            ++depth;
+        } else if (directive->atom() == ELIF) {
+            if (depth == 0 || !sameline(directive, directive->next))
+                return {};
+        } else if (directive->atom() == ELSE) {
+            if (depth == 0)
+                return {};
+        } else if (directive->atom() == ENDIF) {
+            if (depth == 0)
+                break;
+            --depth;
+        }
+        tok = gotoNextLine(directive);
+    }
+    if (!tok)
+        return {};
+
+    // only comments may follow the #endif
+    for (tok = gotoNextLine(tok); tok; tok = tok->next) {
+        if (!tok->comment)
+            return {};
+    }
+    return nameToken->atom();
+}
+
+struct simplecpp::DirectiveIndex::Condition {
+    std::vector<ExpressionStep> steps;
+};
+
+/** compile the expression of an #if or #elif, nullptr if it has comments or can not be compiled */
+static std::shared_ptr<const simplecpp::DirectiveIndex::Condition> compileCondition(const simplecpp::Token *directive)
+{
+    const simplecpp::Token *end = directive->next;
+    while (end && end->location.sameline(directive->location)) {
+        if (end->comment)
+            return nullptr;
+        end = end->next;
+    }
+    std::shared_ptr<simplecpp::DirectiveIndex::Condition> condition = std::make_shared<simplecpp::DirectiveIndex::Condition>();
+    if (!ExpressionCompiler(directive->next, end, true).compile(condition->steps))
+        return nullptr;
+    return condition;
+}
+
+simplecpp::DirectiveIndex::DirectiveIndex(const TokenList &tokens)
+{
+    std::vector<std::size_t> groups; // last seen branch of each open conditional
+    for (const Token *tok = tokens.cfront(); tok; tok = tok->next) {
+        if (tok->op != '#' || sameline(tok->previousSkipComments(), tok))
+            continue;
+        const std::size_t pos = mDirectives.size();
+        mDirectives.push_back({tok, NO_BRANCH, nullptr});
+        mPositions.emplace(tok, pos);
+
+        const Token * const directive = tok->next;
+        if (!sameline(tok, directive) || !directive->name)
+            continue;
+        if (directive->atom() == IF || directive->atom() == ELIF)
+            mDirectives[pos].condition = compileCondition(directive);
+        if (directive->atom() == IF || directive->atom() == IFDEF || directive->atom() == IFNDEF) {
+            groups.push_back(pos);
+        } else if (!groups.empty() && (directive->atom() == ELIF || directive->atom() == ELSE)) {
+            mDirectives[groups.back()].nextBranch = pos;
+            groups.back() = pos;
+        } else if (!groups.empty() && directive->atom() == ENDIF) {
+            mDirectives[groups.back()].nextBranch = pos;
+            groups.pop_back();
+        }
+    }
+}
+
+const simplecpp::Token *simplecpp::DirectiveIndex::skip(const Token *hashtok) const
+{
+    const auto it = mPositions.find(hashtok);
+    if (it == mPositions.end())
+        return gotoNextLine(hashtok);
+    const Directive &directive = mDirectives[it->second];
+    if (directive.nextBranch != NO_BRANCH)
+        return mDirectives[directive.nextBranch].hashtok;
+    return (it->second + 1U < mDirectives.size()) ? mDirectives[it->second + 1U].hashtok : nullptr;
+}
+
+const simplecpp::DirectiveIndex::Condition *simplecpp::DirectiveIndex::condition(const Token *hashtok) const
+{
+    const auto it = mPositions.find(hashtok);
+    return (it == mPositions.end()) ? nullptr : mDirectives[it->second].condition.get();
+}
+
+simplecpp::FileData::FileData(std::string filename, TokenList tokens)
+    : filename(std::move(filename))
+    , tokens(std::move(tokens))
+    , includeGuard(findIncludeGuard(this->tokens))
+    , directives(this->tokens)
+{}
+
+simplecpp::FileData::FileData(const FileData &other)
+    : FileData(other.filename, other.tokens)
+{}
+
+/**
+ * Process-wide cache of #include resolutions, shared by all FileDataCache
+ * instances. For each list of include paths it maps the spelling of an
+ * #include, and for a quoted one the directory of the including file, to
+ * the path of the file that was found, or an empty string if none was.
+ */
+class IncludeResolutionCache {
+public:
+    IncludeResolutionCache() {}
+
+    /** @return true if the resolution of key is known, and then its path */
+    bool find(const std::list<std::string> &includePaths, const std::string &key, std::string &path) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto paths_it = m_resolutions.find(includePaths);
+        if (paths_it == m_resolutions.end())
+            return false;
+        const auto it = paths_it->second.find(key);
+        if (it == paths_it->second.end())
+            return false;
+        path = it->second;
+        return true;
+    }
+
+    void add(const std::list<std::string> &includePaths, const std::string &key, const std::string &path) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_resolutions[includePaths].emplace(key, path);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_resolutions.clear();
+    }
+
+private:
+    std::map<std::list<std::string>, std::unordered_map<std::string, std::string>> m_resolutions;
+    std::mutex m_mutex;
+};
+
+static IncludeResolutionCache includeResolutionCache;
+
+/**
+ * Process-wide cache of directory listings. Each directory is read once,
+ * when a path in it is first asked for, and then tells without further
+ * system calls whether a file exists in it. Names are compared case
+ * insensitively on Windows, whose file systems usually are. On macOS a
+ * name that only matches in another case is probed, since its volumes
+ * may be case sensitive.
+ */
+class DirectoryCache {
+public:
+    DirectoryCache() {}
+
+    /** does path exist, like a successful stat() of it */
+    bool exists(const std::string &path) {
+        const std::string::size_type sep = path.rfind('/');
+        const std::string dir = (sep == std::string::npos) ? std::string("./") : path.substr(0, sep + 1);
+        const std::string name = path.substr(sep == std::string::npos ? 0 : sep + 1);
+        if (name.empty() || name == "." || name == "..")
+            return probe(path);
+
+        std::shared_ptr<const Listing> listing;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const auto it = m_listings.find(dir);
+            if (it != m_listings.end())
+                listing = it->second;
+        }
+        if (!listing) {
+            listing = read(dir);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            listing = m_listings.emplace(dir, listing).first->second;
+        }
+
+        if (!listing->readable)
+            return probe(path);
+        const auto entry = listing->entries.find(normalize(name));
+        if (entry == listing->entries.end()) {
+#ifdef __APPLE__
+            if (listing->foldedEntries.find(fold(name)) != listing->foldedEntries.end())
+                return probe(path);
+#endif
+            return false;
+        }
+        // symbolic links can dangle
+        return !entry->second || probe(path);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_listings.clear();
+    }
+
+private:
+    struct Listing {
+        /** false if the directory exists but can not be read, then paths in it are probed */
+        bool readable{true};
+        /** names of the entries, and if they must be probed */
+        std::unordered_map<std::string, bool> entries;
+#ifdef __APPLE__
+        /** lower case names of the entries */
+        std::unordered_set<std::string> foldedEntries;
+#endif
+    };
+
+    static std::string fold(std::string name) {
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+            return static_cast<char>(std::tolower(c));
+        });
+        return name;
+    }
+
+    static std::string normalize(std::string name) {
+#ifdef SIMPLECPP_WINDOWS
+        name = fold(std::move(name));
+#endif
+        return name;
+    }
+
+    static bool probe(const std::string &path) {
+#ifdef _WIN32
+        return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+        struct stat statbuf;
+        return stat(path.c_str(), &statbuf) == 0;
+#endif
+    }
+
+    static std::shared_ptr<const Listing> read(const std::string &dir) {
+        std::shared_ptr<Listing> listing = std::make_shared<Listing>();
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        const HANDLE hFind = FindFirstFileA((dir + '*').c_str(), &data);
+        if (hFind == INVALID_HANDLE_VALUE) {
+            const DWORD err = GetLastError();
+            listing->readable = (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND);
+            return listing;
+        }
+        do {
+            listing->entries.emplace(normalize(data.cFileName), (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0);
+        } while (FindNextFileA(hFind, &data));
+        FindClose(hFind);
+#else
+        DIR * const d = opendir(dir.c_str());
+        if (!d) {
+            listing->readable = (errno == ENOENT || errno == ENOTDIR);
+            return listing;
+        }
+        while (const struct dirent * const entry = readdir(d)) {
+#ifdef DT_LNK
+            const bool mustProbe = (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN);
+#else
+            const bool mustProbe = true;
+#endif
+            listing->entries.emplace(normalize(entry->d_name), mustProbe);
+#ifdef __APPLE__
+            listing->foldedEntries.insert(fold(entry->d_name));
+#endif
+        }
+        closedir(d);
+#endif
+        return listing;
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<const Listing>> m_listings;
+    std::mutex m_mutex;
+};
+
+static DirectoryCache directoryCache;
+
+/**
+ * Search a relative header: next to the including file unless it is a
+ * system header, then on the include paths.
+ * @return the first candidate path for which found(path) is true, empty if there is none
+ */
+template<class Found>
+static std::string findHeader(const std::string &sourcefile, const std::string &header, const simplecpp::DUI &dui, bool systemheader, const Found &found)
+{
+    // prefer first to search the header relatively to source file if found, when not a system header
+    if (!systemheader) {
+        std::string path = simplecpp::simplifyPath(dirPath(sourcefile) + header);
+        if (found(path))
+            return path;
+    }
+
+    // search the header on the include paths (provided by the flags "-I...")
+    for (const auto &includePath : dui.includePaths) {
+        std::string path = simplecpp::simplifyPath(includePath + "/" + header);
+        if (found(path))
+            return path;
+    }
+
+    return "";
+}
+
+/**
+ * Resolve a relative header on disk, memoized in the process-wide
+ * resolution cache.
+ * @return the path of the header, empty if it is not found
+ */
+static std::string resolveHeader(const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader)
+{
+    std::string key(1, systemheader ? '<' : '"');
+    if (!systemheader)
+        key.append(dirPath(sourcefile)).push_back('\0');
+    key += header;
+
+    std::string path;
+    if (!includeResolutionCache.find(dui.includePaths, key, path)) {
+        path = findHeader(sourcefile, header, dui, systemheader, [](const std::string &candidate) {
+            return directoryCache.exists(candidate);
+        });
+        includeResolutionCache.add(dui.includePaths, key, path);
+    }
+    return path;
+}
+
+/** does __has_include find header; like #include, without opening it */
+static bool hasHeader(const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader)
+{
+    if (simplecpp::isAbsolutePath(header))
+        return directoryCache.exists(simplecpp::simplifyPath(header));
+    return !resolveHeader(dui, sourcefile, header, systemheader).empty();
+}
+
+namespace {
+    /**
+     * Persistent cache of lexed files. Every entry holds the tokens and
+     * lexer errors of one file, and is keyed by the file's canonical path.
+     * It is only used while the size, modification time and contents of
+     * the file match the ones recorded in it.
+     */
+    class TokenCache {
+    public:
+        explicit TokenCache(const std::string &dir) : dir(dir) {}
+
+        /** Load the tokens of the opened file path from the cache, or lex it and update the cache */
+        simplecpp::TokenList load(const OpenedFile &file, const std::string &path, std::vector<std::string> &filenames, simplecpp::FileIndex *filesIndex, simplecpp::OutputList *outputList) const;
+
+    private:
+        struct Key {
+            std::string path;
+            std::uint64_t size;
+            std::uint64_t mtime;
+            std::uint64_t hash;
+        };
+
+        static bool stamp(const OpenedFile &file, const std::string &path, Key &key);
+        static std::string canonicalPath(const std::string &path);
+        std::string entryPath(const Key &key) const;
+
+        static void writeKey(ByteWriter &writer, const Key &key);
+        static void encode(ByteWriter &writer, const std::string &path, const simplecpp::TokenList &tokens, const std::vector<std::string> &files, const simplecpp::OutputList &errors);
+        static bool decode(ByteReader &reader, const std::string &path, simplecpp::TokenList &tokens, std::vector<std::string> &files, simplecpp::OutputList &errors);
+        bool read(const std::string &path, const Key &key, simplecpp::TokenList &tokens, std::vector<std::string> &files, simplecpp::OutputList &errors) const;
+        void write(const std::string &path, const Key &key, const simplecpp::TokenList &tokens, const std::vector<std::string> &files, const simplecpp::OutputList &errors) const;
+
+        const std::string &dir;
+    };
+
+    const char TOKEN_CACHE_MAGIC[8] = {'s', 'c', 'p', 'p', 't', 'o', 'k', 's'};
+    const std::uint64_t TOKEN_CACHE_VERSION = 1;
+
+    std::uint64_t fnv1a(const unsigned char *data, std::size_t size, std::uint64_t hash = 14695981039346656037ULL)
+    {
+        for (std::size_t i = 0; i < size; ++i) {
+            hash ^= data[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+}
+
+bool TokenCache::stamp(const OpenedFile &file, const std::string &path, Key &key)
+{
+    if (!file.stamp(key.size, key.mtime))
+        return false;
+    key.path = canonicalPath(path);
+    return true;
+}
+
+std::string TokenCache::canonicalPath(const std::string &path)
+{
+#ifdef _WIN32
+    char buf[MAX_PATH];
+    const DWORD len = GetFullPathNameA(path.c_str(), MAX_PATH, buf, nullptr);
+    if (len > 0 && len < MAX_PATH)
+        return simplecpp::simplifyPath(buf);
+#else
+    char * const real = realpath(path.c_str(), nullptr);
+    if (real) {
+        std::string ret(real);
+        free(real);
+        return ret;
+    }
+#endif
+    return simplecpp::simplifyPath(path);
+}
+
+std::string TokenCache::entryPath(const Key &key) const
+{
+    static const char hex[] = "0123456789abcdef";
+    std::uint64_t hash = fnv1a(reinterpret_cast<const unsigned char *>(key.path.data()), key.path.size());
+    std::string name(16, '0');
+    for (std::size_t i = 16; i > 0; --i, hash >>= 4)
+        name[i - 1] = hex[hash & 0xf];
+    return dir + '/' + name + ".tokens";
+}
+
+void TokenCache::writeKey(ByteWriter &writer, const Key &key)
+{
+    writer.bytes(TOKEN_CACHE_MAGIC, sizeof(TOKEN_CACHE_MAGIC));
+    writer.varint(TOKEN_CACHE_VERSION);
+    writer.str(key.path);
+    writer.varint(key.size);
+    writer.varint(key.mtime);
+    writer.varint(key.hash);
+}
+
+/*
+ * Entry layout after the key: the token records, with the lexed file as the
+ * placeholder since its name depends on the path it is reached by, followed
+ * by the lexer errors: count, then type, file name, line, column and message.
+ */
+void TokenCache::encode(ByteWriter &writer, const std::string &path, const simplecpp::TokenList &tokens, const std::vector<std::string> &files, const simplecpp::OutputList &errors)
+{
+    writeTokens(writer, tokens, path);
+
+    writer.varint(errors.size());
+    for (const simplecpp::Output &err : errors) {
+        writer.varint(err.type);
+        writer.str(err.location.fileIndex < files.size() ? files[err.location.fileIndex] : path);
+        writer.varint(err.location.line);
+        writer.varint(err.location.col);
+        writer.str(err.msg);
+    }
+}
+
+bool TokenCache::decode(ByteReader &reader, const std::string &path, simplecpp::TokenList &tokens, std::vector<std::string> &files, simplecpp::OutputList &errors)
+{
+    if (!readTokens(reader, tokens, files, path))
+        return false;
+
+    const std::uint64_t errorCount = reader.varint();
+    for (std::uint64_t i = 0; reader.ok && i < errorCount; ++i) {
+        const std::uint64_t type = reader.varint();
+        const std::string file = reader.str();
+        simplecpp::Location errloc;
+        errloc.fileIndex = fileIndexIn(files, file);
+        errloc.line = static_cast<unsigned int>(reader.varint());
+        errloc.col = static_cast<unsigned int>(reader.varint());
+        std::string msg = reader.str();
+        if (type > simplecpp::Output::DUI_ERROR)
+            return false;
+        errors.emplace_back(static_cast<simplecpp::Output::Type>(type), errloc, std::move(msg));
+    }
+
+    return reader.ok && reader.atEnd();
+}
+
+bool TokenCache::read(const std::string &path, const Key &key, simplecpp::TokenList &tokens, std::vector<std::string> &files, simplecpp::OutputList &errors) const
+{
+    std::vector<std::string> unused;
+    std::unique_ptr<FileBuffer> buffer;
+    try {
+        buffer.reset(new FileBuffer(entryPath(key), unused));
+    } catch (const simplecpp::Output &) {
+        return false;
+    }
+
+    std::string expected;
+    ByteWriter writer(expected);
+    writeKey(writer, key);
+
+    ByteReader reader(buffer->data(), buffer->size());
+    return reader.bytes(expected.data(), expected.size()) && decode(reader, path, tokens, files, errors);
+}
+
+void TokenCache::write(const std::string &path, const Key &key, const simplecpp::TokenList &tokens, const std::vector<std::string> &files, const simplecpp::OutputList &errors) const
+{
+    std::string data;
+    ByteWriter writer(data);
+    writeKey(writer, key);
+    encode(writer, path, tokens, files, errors);
+
+    // write a private file and rename it so readers never see a partial entry
+    static std::atomic<unsigned int> counter{0};
+#ifdef _WIN32
+    const unsigned long pid = GetCurrentProcessId();
+#else
+    const unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+    const std::string entry = entryPath(key);
+    const std::string tmp = entry + '.' + std::to_string(pid) + '.' + std::to_string(counter++) + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    out.close();
+    if (out.fail()) {
+        // drop the partial file so failed writes don't pile up in the cache directory
+        std::remove(tmp.c_str());
+        return;
+    }
+#ifdef _WIN32
+    if (!MoveFileExA(tmp.c_str(), entry.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+    if (std::rename(tmp.c_str(), entry.c_str()) != 0)
+#endif
+        std::remove(tmp.c_str());
+}
+
+simplecpp::TokenList TokenCache::load(const OpenedFile &file, const std::string &path, std::vector<std::string> &filenames, simplecpp::FileIndex *filesIndex, simplecpp::OutputList *outputList) const
+{
+    const FileBuffer source(file);
+    Key key;
+    if (!stamp(file, path, key))
+        return simplecpp::TokenList({reinterpret_cast<const char *>(source.data()), source.size()}, filenames, path, outputList, filesIndex);
+    key.hash = fnv1a(source.data(), source.size());
+
+    std::vector<std::string> files;
+    simplecpp::TokenList cached(files);
+    simplecpp::OutputList errors;
+    if (!read(path, key, cached, files, errors)) {
+        cached.clear();
+        files.clear();
+        errors.clear();
+        simplecpp::TokenList lexed({reinterpret_cast<const char *>(source.data()), source.size()}, files, path, &errors);
+        write(path, key, lexed, files, errors);
+        cached.takeTokens(lexed);
+    }
+
+    // the locations are relative to the entry's file table, and lexing
+    // always adds the file itself first
+    fileIndexIn(filenames, path, filesIndex);
+    std::vector<unsigned int> fileIndexes;
+    for (const std::string &file : files)
+        fileIndexes.push_back(fileIndexIn(filenames, file, filesIndex));
+    for (simplecpp::Token *tok = cached.front(); tok; tok = tok->next)
+        tok->location.fileIndex = fileIndexes[tok->location.fileIndex];
+    if (outputList) {
+        for (simplecpp::Output &err : errors) {
+            err.location.fileIndex = fileIndexes[err.location.fileIndex];
+            outputList->emplace_back(std::move(err));
+        }
+    }
+
+    simplecpp::TokenList tokens(filenames, filesIndex);
+    tokens.takeTokens(cached);
+    return tokens;
+}
+
+/** Lex the opened file path, through the persistent token cache if there is one */
+static simplecpp::TokenList lexFile(const OpenedFile &file, const std::string &path, std::vector<std::string> &filenames, simplecpp::FileIndex *filesIndex, simplecpp::OutputList *outputList, const std::string &persistentDir)
+{
+    if (persistentDir.empty()) {
+        const FileBuffer source(file);
+        return simplecpp::TokenList({reinterpret_cast<const char *>(source.data()), source.size()}, filenames, path, outputList, filesIndex);
+    }
+    return TokenCache(persistentDir).load(file, path, filenames, filesIndex, outputList);
+}
+
+/**
+ * Move tokens lexed with their own file names into a list of a cache. Their
+ * locations then refer to filenames, or to the shared file names for a
+ * concurrent cache. The errors are reported with indexes into filenames.
+ */
+static simplecpp::TokenList adoptTokens(simplecpp::TokenList &lexed, const std::vector<std::string> &files, simplecpp::OutputList &errors, std::vector<std::string> &filenames, simplecpp::FileIndex *filesIndex, simplecpp::OutputList *outputList, bool shared)
+{
+    // shared token lists never add files, so all of them can refer to the same empty list
+    static std::vector<std::string> noFiles;
+
+    std::vector<unsigned int> fileIndexes;
+    for (const std::string &file : files)
+        fileIndexes.push_back(shared ? sharedFileNames().index(file) : fileIndexIn(filenames, file, filesIndex));
+    for (simplecpp::Token *tok = lexed.front(); tok; tok = tok->next)
+        tok->location.fileIndex = fileIndexes[tok->location.fileIndex];
+
+    for (simplecpp::Output &err : errors) {
+        if (err.location.fileIndex < files.size())
+            err.location.fileIndex = fileIndexIn(filenames, files[err.location.fileIndex], filesIndex);
+        outputList->emplace_back(std::move(err));
+    }
+
+    simplecpp::TokenList tokens(shared ? noFiles : filenames, shared ? nullptr : filesIndex);
+    tokens.takeTokens(lexed);
+    return tokens;
+}
+
+/** Lex a file for a concurrent cache, its locations refer to the shared file names */
+static simplecpp::TokenList lexShared(const OpenedFile &file, const std::string &path, std::vector<std::string> &filenames, simplecpp::FileIndex *filesIndex, simplecpp::OutputList *outputList, const std::string &persistentDir)
+{
+    std::vector<std::string> files;
+    simplecpp::OutputList errors;
+    simplecpp::TokenList lexed = lexFile(file, path, files, nullptr, outputList ? &errors : nullptr, persistentDir);
+    return adoptTokens(lexed, files, errors, filenames, filesIndex, outputList, true);
+}
+
+/** the identity of an opened file, as a FileDataCache::FileID */
+template<class FileID>
+static bool getFileId(const OpenedFile &file, FileID &id)
+{
+#ifdef _WIN32
+    BOOL ret = GetFileInformationByHandleEx(file.handle(), FileIdInfo, &id.fileIdInfo, sizeof(id.fileIdInfo));
+    if (!ret) {
+        const DWORD err = GetLastError();
+        if (err == ERROR_INVALID_PARAMETER || // encountered when using a non-NTFS filesystem e.g. exFAT
+            err == ERROR_NOT_SUPPORTED) // encountered on Windows Server Core (used as a Docker container)
+        {
+            const BY_HANDLE_FILE_INFORMATION &fileInfo = file.information();
+            id.fileIdInfo.VolumeSerialNumber = static_cast<std::uint64_t>(fileInfo.dwVolumeSerialNumber);
+            id.fileIdInfo.FileId.IdentifierHi = static_cast<std::uint64_t>(fileInfo.nFileIndexHigh);
+            id.fileIdInfo.FileId.IdentifierLo = static_cast<std::uint64_t>(fileInfo.nFileIndexLow);
+            ret = TRUE;
+        }
+    }
+    return ret == TRUE;
+#else
+    id.dev = file.status().st_dev;
+    id.ino = file.status().st_ino;
+    return true;
+#endif
+}
+
+/** is s a "header" or <header> name, not a macro to be expanded */
+static bool isHeaderName(const std::string &s)
+{
+    return s.size() >= 2U && ((s.front() == '\"' && s.back() == '\"') || (s.front() == '<' && s.back() == '>'));
+}
+
+struct simplecpp::FileDataCache::Shared {
+    /** once-initialized result of looking up one path */
+    struct Slot {
+        std::once_flag once;
+        FileData *data{};
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<Slot>> slots;
+};
+
+/**
+ * The include walk of a parallel simplecpp::load() or simplecpp::preprocess()
+ * schedules the headers it may load, and the headers they include are
+ * scheduled as they are lexed. The workers resolve and lex them with their
+ * own file names. When the walk loads a header it takes its tokens, waiting
+ * if a worker is still lexing it, and lexes headers that were not prefetched
+ * itself. Headers the walk never takes, e.g. in inactive #if branches, are
+ * dropped with their lexer errors.
+ */
+class simplecpp::FileDataCache::Prefetcher {
+public:
+    /**
+     * Start prefetching the headers included by rawtokens, and the -include
+     * files of dui if withIncludes is true.
+     * nullptr if cache loads its headers one at a time.
+     */
+    static std::unique_ptr<Prefetcher> create(FileDataCache &cache, const DUI &dui, const TokenList &rawtokens, bool withIncludes, bool reportErrors) {
+        // a cache with inserted files looks up every candidate of a header, which is not resolved ahead
+        if (cache.mLoadThreads <= 1 || cache.hasInsertedFiles())
+            return nullptr;
+        std::unique_ptr<Prefetcher> prefetcher(new Prefetcher(cache, dui, reportErrors));
+        if (withIncludes) {
+            for (const std::string &filename : dui.includes)
+                prefetcher->schedule("", filename, false);
+        }
+        prefetcher->schedule(rawtokens);
+        return prefetcher;
+    }
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher &operator=(const Prefetcher&) = delete;
+
+    ~Prefetcher() {
+        {
+            const std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mScheduled.notify_all();
+        for (std::thread &thread : mThreads)
+            thread.join();
+    }
+
+    /** FileDataCache::get() using the prefetched tokens */
+    std::pair<FileData *, bool> get(const std::string &sourcefile, const std::string &header, bool systemheader, std::vector<std::string> &filenames, OutputList *outputList, FileIndex *filesIndex) {
+        return mCache.get(sourcefile, header, mDui, systemheader, filenames, outputList, filesIndex, this);
+    }
+
+    void schedule(const std::string &sourcefile, const std::string &header, bool systemheader) {
+        {
+            const std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back({sourcefile, header, systemheader});
+        }
+        mScheduled.notify_one();
+    }
+
+    /** schedule the headers of the #include directives in tokens */
+    void schedule(const TokenList &tokens) {
+        std::vector<Job> jobs;
+        for (const Token *tok = tokens.cfront(); tok; tok = tok->next) {
+            if (tok->op != '#' || sameline(tok->previousSkipComments(), tok))
+                continue;
+            const Token * const inctok = tok->nextSkipComments();
+            if (!inctok || inctok->atom() != INCLUDE)
+                continue;
+            const Token * const htok = inctok->nextSkipComments();
+            if (!sameline(inctok, htok) || !isHeaderName(htok->str()))
+                continue;
+            jobs.push_back({tokens.file(inctok->location), htok->str().substr(1U, htok->str().size() - 2U), htok->str()[0] == '<'});
+            tok = inctok;
+        }
+        if (jobs.empty())
+            return;
+        {
+            const std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.insert(mJobs.end(), std::make_move_iterator(jobs.begin()), std::make_move_iterator(jobs.end()));
+        }
+        mScheduled.notify_all();
+    }
+
+    /** The tokens of the opened file path for the cache */
+    TokenList take(const OpenedFile &file, const std::string &path, std::vector<std::string> &filenames, FileIndex *filesIndex, OutputList *outputList) {
+        std::unique_ptr<Lexed> lexed;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            const auto ins = mFiles.emplace(path, nullptr);
+            if (!ins.second && ins.first->second) {
+                const Lexed * const pending = ins.first->second.get();
+                mLexed.wait(lock, [pending]() {
+                    return pending->done;
+                });
+                lexed = std::move(ins.first->second);
+            }
+        }
+        if (lexed && lexed->tokens)
+            return adoptTokens(*lexed->tokens, lexed->files, lexed->errors, filenames, filesIndex, outputList, mCache.isConcurrent());
+
+        TokenList tokens = mCache.isConcurrent() ? lexShared(file, path, filenames, filesIndex, outputList, mCache.mPersistentDir) : lexFile(file, path, filenames, filesIndex, outputList, mCache.mPersistentDir);
+        schedule(tokens);
+        return tokens;
+    }
+
+private:
+    Prefetcher(FileDataCache &cache, const DUI &dui, bool reportErrors)
+        : mCache(cache)
+        , mDui(dui)
+        , mReportErrors(reportErrors)
+    {
+        // the files that are already loaded are not lexed again
+        {
+            std::unique_lock<std::mutex> lock;
+            if (cache.mShared)
+                lock = std::unique_lock<std::mutex>(cache.mShared->mutex);
+            for (const auto &name : cache.mNameMap)
+                mFiles.emplace(name.first, nullptr);
+        }
+        for (unsigned int i = 0; i < cache.mLoadThreads; ++i)
+            mThreads.emplace_back(&Prefetcher::work, this);
+    }
+
+    struct Job {
+        std::string sourcefile;
+        std::string header;
+        bool systemheader;
+    };
 
-private:
-    std::set<std::string> m_pathSet;
-    std::mutex m_mutex;
-};
+    /** a header lexed by a worker */
+    struct Lexed {
+        std::vector<std::string> files;
+        std::unique_ptr<TokenList> tokens;
+        OutputList errors;
+        bool done{};
+    };
 
-static NonExistingFilesCache nonExistingFilesCache;
+    void work() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;) {
+            mScheduled.wait(lock, [this]() {
+                return mStop || !mJobs.empty();
+            });
+            if (mStop)
+                return;
+            const Job job = std::move(mJobs.front());
+            mJobs.pop_front();
+            lock.unlock();
+            lex(job);
+            lock.lock();
+        }
+    }
 
-#endif
+    void lex(const Job &job) {
+        const std::string path = isAbsolutePath(job.header) ? simplifyPath(job.header) : resolveHeader(mDui, job.sourcefile, job.header, job.systemheader);
+        if (path.empty())
+            return;
 
-static std::string openHeaderDirect(std::ifstream &f, const std::string &path)
-{
-#ifdef SIMPLECPP_WINDOWS
-    if (nonExistingFilesCache.contains(path))
-        return "";  // file is known not to exist, skip expensive file open call
-#endif
-    f.open(path.c_str());
-    if (f.is_open())
-        return path;
-#ifdef SIMPLECPP_WINDOWS
-    nonExistingFilesCache.add(path);
-#endif
-    return "";
-}
+        Lexed *lexed;
+        {
+            const std::lock_guard<std::mutex> lock(mMutex);
+            const auto ins = mFiles.emplace(path, nullptr);
+            if (!ins.second)
+                return;
+            ins.first->second.reset(new Lexed);
+            lexed = ins.first->second.get();
+        }
 
-static std::string openHeader(std::ifstream &f, const simplecpp::DUI &dui, const std::string &sourcefile, const std::string &header, bool systemheader)
-{
-    if (simplecpp::isAbsolutePath(header))
-        return openHeaderDirect(f, simplecpp::simplifyPath(header));
+        const OpenedFile file(path);
+        if (file.isOpen()) {
+            lexed->tokens.reset(new TokenList(lexFile(file, path, lexed->files, nullptr, mReportErrors ? &lexed->errors : nullptr, mCache.mPersistentDir)));
+            schedule(*lexed->tokens);
+        }
 
-    // prefer first to search the header relatively to source file if found, when not a system header
-    if (!systemheader) {
-        std::string path = openHeaderDirect(f, simplecpp::simplifyPath(dirPath(sourcefile) + header));
-        if (!path.empty()) {
-            return path;
+        {
+            const std::lock_guard<std::mutex> lock(mMutex);
+            lexed->done = true;
         }
+        mLexed.notify_all();
     }
 
-    // search the header on the include paths (provided by the flags "-I...")
-    for (const auto &includePath : dui.includePaths) {
-        std::string path = openHeaderDirect(f, simplecpp::simplifyPath(includePath + "/" + header));
-        if (!path.empty())
-            return path;
-    }
-    return "";
-}
+    FileDataCache &mCache;
+    const DUI &mDui;
+    const bool mReportErrors;
+
+    std::mutex mMutex;
+    /** a job was scheduled or the workers must stop */
+    std::condition_variable mScheduled;
+    /** a worker has lexed a header */
+    std::condition_variable mLexed;
+    std::deque<Job> mJobs;
+    /** every path that is claimed; null if the walk takes care of it */
+    std::unordered_map<std::string, std::unique_ptr<Lexed>> mFiles;
+    bool mStop{};
+    std::vector<std::thread> mThreads;
+};
 
-std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::tryload(FileDataCache::name_map_type::iterator &name_it, const simplecpp::DUI &dui, std::vector<std::string> &filenames, simplecpp::OutputList *outputList)
+std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::tryload(FileDataCache::name_map_type::iterator &name_it, const simplecpp::DUI &dui, std::vector<std::string> &filenames, simplecpp::OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher)
 {
     const std::string &path = name_it->first;
+    const OpenedFile file(path);
     FileID fileId;
 
-    if (!getFileId(path, fileId))
+    if (!file.isOpen() || !getFileId(file, fileId))
         return {nullptr, false};
 
     const auto id_it = mIdMap.find(fileId);
@@ -3089,7 +5504,7 @@ std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::tryload(FileDat
         return {id_it->second, false};
     }
 
-    auto *const data = new FileData {path, TokenList(path, filenames, outputList)};
+    auto *const data = new FileData {path, prefetcher ? prefetcher->take(file, path, filenames, filesIndex, outputList) : lexFile(file, path, filenames, filesIndex, outputList, mPersistentDir)};
 
     if (dui.removeComments)
         data->tokens.removeComments();
@@ -3101,108 +5516,163 @@ std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::tryload(FileDat
     return {data, true};
 }
 
-std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::get(const std::string &sourcefile, const std::string &header, const simplecpp::DUI &dui, bool systemheader, std::vector<std::string> &filenames, simplecpp::OutputList *outputList)
+simplecpp::FileDataCache simplecpp::FileDataCache::concurrent()
 {
-    if (isAbsolutePath(header)) {
-        auto ins = mNameMap.emplace(simplecpp::simplifyPath(header), nullptr);
+    FileDataCache cache;
+    cache.mShared = std::make_shared<Shared>();
+    return cache;
+}
 
-        if (ins.second) {
-            const auto ret = tryload(ins.first, dui, filenames, outputList);
-            if (ret.first != nullptr) {
-                return ret;
-            }
-        } else {
-            return {ins.first->second, false};
-        }
+void simplecpp::FileDataCache::insert(FileData data)
+{
+    // NOLINTNEXTLINE(misc-const-correctness) - FP
+    auto *const newdata = new FileData(std::move(data));
+
+    std::unique_lock<std::mutex> lock;
+    if (mShared)
+        lock = std::unique_lock<std::mutex>(mShared->mutex);
+    mData.emplace_back(newdata);
+    mNameMap.emplace(newdata->filename, newdata);
+    mHasInsertedFiles = true;
+}
+
+void simplecpp::FileDataCache::clear()
+{
+    if (mShared)
+        mShared->slots.clear();
+    mNameMap.clear();
+    mIdMap.clear();
+    mData.clear();
+    mHasInsertedFiles = false;
+}
+
+std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::tryloadShared(const std::string &path, const simplecpp::DUI &dui, std::vector<std::string> &filenames, simplecpp::OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher)
+{
+    const OpenedFile file(path);
+    FileID fileId;
 
+    if (!file.isOpen() || !getFileId(file, fileId))
         return {nullptr, false};
+
+    {
+        const std::lock_guard<std::mutex> lock(mShared->mutex);
+        const auto id_it = mIdMap.find(fileId);
+        if (id_it != mIdMap.end())
+            return {id_it->second, false};
     }
 
-    if (!systemheader) {
-        auto ins = mNameMap.emplace(simplecpp::simplifyPath(dirPath(sourcefile) + header), nullptr);
+    // the file is lexed without holding the lock; if another path to the same
+    // file was loaded meanwhile that copy wins
+    std::unique_ptr<FileData> data(new FileData {path, prefetcher ? prefetcher->take(file, path, filenames, filesIndex, outputList) : lexShared(file, path, filenames, filesIndex, outputList, mPersistentDir)});
 
-        if (ins.second) {
-            const auto ret = tryload(ins.first, dui, filenames, outputList);
-            if (ret.first != nullptr) {
-                return ret;
-            }
-        } else if (ins.first->second != nullptr) {
-            return {ins.first->second, false};
-        }
-    }
+    if (dui.removeComments)
+        data->tokens.removeComments();
 
-    for (const auto &includePath : dui.includePaths) {
-        auto ins = mNameMap.emplace(simplecpp::simplifyPath(includePath + "/" + header), nullptr);
+    const std::lock_guard<std::mutex> lock(mShared->mutex);
+    const auto ins = mIdMap.emplace(fileId, data.get());
+    if (!ins.second)
+        return {ins.first->second, false};
+    mData.emplace_back(std::move(data));
+    return {mData.back().get(), true};
+}
 
-        if (ins.second) {
-            const auto ret = tryload(ins.first, dui, filenames, outputList);
-            if (ret.first != nullptr) {
-                return ret;
-            }
-        } else if (ins.first->second != nullptr) {
-            return {ins.first->second, false};
-        }
+std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::lookup(const std::string &path, const simplecpp::DUI &dui, std::vector<std::string> &filenames, simplecpp::OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher)
+{
+    if (!mShared) {
+        auto ins = mNameMap.emplace(path, nullptr);
+        if (ins.second)
+            return tryload(ins.first, dui, filenames, outputList, filesIndex, prefetcher);
+        return {ins.first->second, false};
+    }
+
+    std::shared_ptr<Shared::Slot> slot;
+    {
+        const std::lock_guard<std::mutex> lock(mShared->mutex);
+        const auto name_it = mNameMap.find(path);
+        if (name_it != mNameMap.end())
+            return {name_it->second, false};
+        std::shared_ptr<Shared::Slot> &s = mShared->slots[path];
+        if (!s)
+            s = std::make_shared<Shared::Slot>();
+        slot = s;
     }
 
-    return {nullptr, false};
+    bool loaded = false;
+    std::call_once(slot->once, [&]() {
+        const auto ret = tryloadShared(path, dui, filenames, outputList, filesIndex, prefetcher);
+        slot->data = ret.first;
+        loaded = ret.second;
+
+        const std::lock_guard<std::mutex> lock(mShared->mutex);
+        mNameMap.emplace(path, ret.first);
+    });
+    return {slot->data, loaded};
 }
 
-bool simplecpp::FileDataCache::getFileId(const std::string &path, FileID &id)
+std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::get(const std::string &sourcefile, const std::string &header, const simplecpp::DUI &dui, bool systemheader, std::vector<std::string> &filenames, simplecpp::OutputList *outputList, FileIndex *filesIndex)
 {
-#ifdef _WIN32
-    HANDLE hFile = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    return get(sourcefile, header, dui, systemheader, filenames, outputList, filesIndex, nullptr);
+}
 
-    if (hFile == INVALID_HANDLE_VALUE)
-        return false;
+std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::get(const std::string &sourcefile, const std::string &header, const simplecpp::DUI &dui, bool systemheader, std::vector<std::string> &filenames, simplecpp::OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher)
+{
+    if (isAbsolutePath(header))
+        return lookup(simplecpp::simplifyPath(header), dui, filenames, outputList, filesIndex, prefetcher);
 
-    BOOL ret = GetFileInformationByHandleEx(hFile, FileIdInfo, &id.fileIdInfo, sizeof(id.fileIdInfo));
-    if (!ret) {
-        const DWORD err = GetLastError();
-        if (err == ERROR_INVALID_PARAMETER || // encountered when using a non-NTFS filesystem e.g. exFAT
-            err == ERROR_NOT_SUPPORTED) // encountered on Windows Server Core (used as a Docker container)
-        {
-            BY_HANDLE_FILE_INFORMATION fileInfo;
-            ret = GetFileInformationByHandle(hFile, &fileInfo);
-            if (ret) {
-                id.fileIdInfo.VolumeSerialNumber = static_cast<std::uint64_t>(fileInfo.dwVolumeSerialNumber);
-                id.fileIdInfo.FileId.IdentifierHi = static_cast<std::uint64_t>(fileInfo.nFileIndexHigh);
-                id.fileIdInfo.FileId.IdentifierLo = static_cast<std::uint64_t>(fileInfo.nFileIndexLow);
-            }
-        }
+    // inserted files need not exist on disk, so every candidate must be looked up
+    if (!hasInsertedFiles()) {
+        const std::string path = resolveHeader(dui, sourcefile, header, systemheader);
+        if (path.empty())
+            return {nullptr, false};
+        return lookup(path, dui, filenames, outputList, filesIndex, prefetcher);
     }
 
-    CloseHandle(hFile);
-
-    return ret == TRUE;
-#else
-    struct stat statbuf;
-
-    if (stat(path.c_str(), &statbuf) != 0)
-        return false;
+    std::pair<FileData *, bool> ret{nullptr, false};
+    findHeader(sourcefile, header, dui, systemheader, [&](const std::string &candidate) {
+        ret = lookup(candidate, dui, filenames, outputList, filesIndex, prefetcher);
+        return ret.first != nullptr;
+    });
+    return ret;
+}
 
-    id.dev = statbuf.st_dev;
-    id.ino = statbuf.st_ino;
+bool simplecpp::FileDataCache::hasInsertedFiles() const
+{
+    std::unique_lock<std::mutex> lock;
+    if (mShared)
+        lock = std::unique_lock<std::mutex>(mShared->mutex);
+    return mHasInsertedFiles;
+}
 
-    return true;
-#endif
+/** The index of files used by tokens, nullptr if there is none */
+static simplecpp::FileIndex *fileIndexOf(const simplecpp::TokenList &tokens, const std::vector<std::string> &files)
+{
+    simplecpp::FileIndex * const filesIndex = tokens.getFileIndex();
+    return (filesIndex && &filesIndex->files() == &files) ? filesIndex : nullptr;
 }
 
-simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens, std::vector<std::string> &filenames, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, FileDataCache cache)
+static void loadIncludes(const simplecpp::TokenList &rawtokens, std::vector<std::string> &filenames, simplecpp::FileIndex *filesIndex, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, simplecpp::FileDataCache &cache)
 {
-#ifdef SIMPLECPP_WINDOWS
-    if (dui.clearIncludeCache)
-        nonExistingFilesCache.clear();
-#endif
+    if (dui.clearIncludeCache) {
+        includeResolutionCache.clear();
+        directoryCache.clear();
+    }
+
+    const std::unique_ptr<simplecpp::FileDataCache::Prefetcher> prefetcher = simplecpp::FileDataCache::Prefetcher::create(cache, dui, rawtokens, true, outputList != nullptr);
+    const auto get = [&](const std::string &sourcefile, const std::string &header, bool systemheader) {
+        if (prefetcher)
+            return prefetcher->get(sourcefile, header, systemheader, filenames, outputList, filesIndex);
+        return cache.get(sourcefile, header, dui, systemheader, filenames, outputList, filesIndex);
+    };
 
-    std::list<const Token *> filelist;
+    std::list<const simplecpp::Token *> filelist;
 
     // -include files
     for (auto it = dui.includes.cbegin(); it != dui.includes.cend(); ++it) {
         const std::string &filename = *it;
 
-        const auto loadResult = cache.get("", filename, dui, false, filenames, outputList);
+        const auto loadResult = get("", filename, false);
         const bool loaded = loadResult.second;
-        FileData *const filedata = loadResult.first;
+        simplecpp::FileData *const filedata = loadResult.first;
 
         if (filedata == nullptr) {
             if (outputList) {
@@ -3228,7 +5698,7 @@ simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens,
         filelist.emplace_back(filedata->tokens.front());
     }
 
-    for (const Token *rawtok = rawtokens.cfront(); rawtok || !filelist.empty(); rawtok = rawtok ? rawtok->next : nullptr) {
+    for (const simplecpp::Token *rawtok = rawtokens.cfront(); rawtok || !filelist.empty(); rawtok = rawtok ? rawtok->next : nullptr) {
         if (rawtok == nullptr) {
             rawtok = filelist.back();
             filelist.pop_back();
@@ -3238,25 +5708,25 @@ simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens,
             continue;
 
         rawtok = rawtok->nextSkipComments();
-        if (!rawtok || rawtok->str() != INCLUDE)
+        if (!rawtok || rawtok->atom() != INCLUDE)
             continue;
 
         const std::string &sourcefile = rawtokens.file(rawtok->location);
 
-        const Token * const htok = rawtok->nextSkipComments();
+        const simplecpp::Token * const htok = rawtok->nextSkipComments();
         if (!sameline(rawtok, htok))
             continue;
 
         const bool systemheader = (htok->str()[0] == '<');
         const std::string header(htok->str().substr(1U, htok->str().size() - 2U));
 
-        const auto loadResult = cache.get(sourcefile, header, dui, systemheader, filenames, outputList);
+        const auto loadResult = get(sourcefile, header, systemheader);
         const bool loaded = loadResult.second;
 
         if (!loaded)
             continue;
 
-        FileData *const filedata = loadResult.first;
+        simplecpp::FileData *const filedata = loadResult.first;
 
         if (!filedata->tokens.front())
             continue;
@@ -3266,14 +5736,18 @@ simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens,
 
         filelist.emplace_back(filedata->tokens.front());
     }
+}
 
+simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens, std::vector<std::string> &filenames, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, FileDataCache cache)
+{
+    loadIncludes(rawtokens, filenames, fileIndexOf(rawtokens, filenames), dui, outputList, cache);
     return cache;
 }
 
 static bool preprocessToken(simplecpp::TokenList &output, const simplecpp::Token *&tok1, simplecpp::MacroMap &macros, std::vector<std::string> &files, simplecpp::OutputList *outputList)
 {
     const simplecpp::Token * const tok = tok1;
-    const simplecpp::MacroMap::const_iterator it = tok->name ? macros.find(tok->str()) : macros.end();
+    const simplecpp::MacroMap::const_iterator it = tok->name ? macros.find(tok->atom()) : macros.end();
     if (it != macros.end()) {
         simplecpp::TokenList value(files);
         try {
@@ -3298,6 +5772,70 @@ static bool preprocessToken(simplecpp::TokenList &output, const simplecpp::Token
     return true;
 }
 
+/**
+ * Evaluate an #if or #elif with the expression that was compiled when its
+ * file was loaded, and record the same macro usage and ifCond as the
+ * evaluation of the preprocessed expression. Without any side effect,
+ * false is returned when there is no compiled expression, a macro in it is
+ * not a single number, or it can not be evaluated; the expression must
+ * then be preprocessed.
+ */
+static bool evaluateCondition(const simplecpp::DirectiveIndex::Condition *condition, const simplecpp::Token *rawtok, const simplecpp::MacroMap &macros, bool hasInclude, std::map<std::string, std::list<simplecpp::Location>> &maybeUsedMacros, std::list<simplecpp::IfCond> *ifCond, long long &result)
+{
+    if (!condition)
+        return false;
+
+    const auto isDefined = [&](const simplecpp::Token *tok) {
+        return macros.find(tok->atom()) != macros.end() || (hasInclude && tok->atom() == HAS_INCLUDE);
+    };
+    const auto resolve = [&](const ExpressionStep &step, long long &value) {
+        if (step.kind == ExpressionStep::DEFINED) {
+            value = isDefined(step.tok);
+            return true;
+        }
+        const simplecpp::MacroMap::const_iterator it = macros.find(step.tok->atom());
+        if (it == macros.end()) {
+            value = 0;
+            return true;
+        }
+        const simplecpp::Token * const number = it->second.numberValue();
+        return number && integerValue(number->str(), value);
+    };
+    if (!runExpression(condition->steps, resolve, result))
+        return false;
+
+    for (const ExpressionStep &step : condition->steps) {
+        if (step.kind != ExpressionStep::NAME && step.kind != ExpressionStep::DEFINED)
+            continue;
+        maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
+        const simplecpp::MacroMap::const_iterator it = (step.kind == ExpressionStep::NAME) ? macros.find(step.tok->atom()) : macros.end();
+        if (it != macros.end())
+            it->second.addUsage(step.tok->location);
+    }
+
+    if (ifCond) {
+        // the preprocessed expression: defined operators are replaced by their value, macros by their number
+        std::string E;
+        for (const simplecpp::Token *tok = rawtok->next; tok && tok->location.sameline(rawtok->location); tok = tok->next) {
+            E += E.empty() ? "" : " ";
+            if (tok->name && tok->atom() == DEFINED) {
+                tok = tok->next;
+                const bool par = (tok->op == '(');
+                if (par)
+                    tok = tok->next;
+                E += isDefined(tok) ? "1" : "0";
+                if (par)
+                    tok = tok->next;
+                continue;
+            }
+            const simplecpp::MacroMap::const_iterator it = tok->name ? macros.find(tok->atom()) : macros.end();
+            E += (it != macros.end()) ? it->second.numberValue()->str() : tok->str();
+        }
+        ifCond->emplace_back(rawtok->location, E, result);
+    }
+    return true;
+}
+
 static void getLocaltime(struct tm &ltime)
 {
     time_t t;
@@ -3324,12 +5862,113 @@ static std::string getTimeDefine(const struct tm *timep)
     return std::string("\"").append(buf).append("\"");
 }
 
-void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenList &rawtokens, std::vector<std::string> &files, simplecpp::FileDataCache &cache, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
+namespace {
+    /**
+     * Tokens of a concurrent FileDataCache or a Prefix carry shared file
+     * indexes. When preprocess() returns, this maps every location it
+     * produced to the caller's files.
+     */
+    class SharedLocationMapper {
+    public:
+        SharedLocationMapper(bool enabled, simplecpp::TokenList &output, std::vector<std::string> &files, simplecpp::FileIndex *filesIndex, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
+            : mEnabled(enabled)
+            , mOutput(output)
+            , mFiles(files)
+            , mFilesIndex(filesIndex)
+            , mOutputList(outputList)
+            , mMacroUsage(macroUsage)
+            , mIfCond(ifCond)
+        {}
+
+        SharedLocationMapper(const SharedLocationMapper &) = delete;
+        SharedLocationMapper &operator=(const SharedLocationMapper &) = delete;
+
+        ~SharedLocationMapper() {
+            if (!mEnabled)
+                return;
+            for (simplecpp::Token *tok = mOutput.front(); tok; tok = tok->next)
+                map(tok->location);
+            if (mOutputList) {
+                for (simplecpp::Output &out : *mOutputList)
+                    map(out.location);
+            }
+            if (mMacroUsage) {
+                for (simplecpp::MacroUsage &mu : *mMacroUsage) {
+                    map(mu.macroLocation);
+                    map(mu.useLocation);
+                }
+            }
+            if (mIfCond) {
+                for (simplecpp::IfCond &ifc : *mIfCond)
+                    map(ifc.location);
+            }
+        }
+
+    private:
+        void map(simplecpp::Location &loc) {
+            if (!(loc.fileIndex & SHARED_FILE_INDEX))
+                return;
+            auto it = mIndexes.find(loc.fileIndex);
+            if (it == mIndexes.end())
+                it = mIndexes.emplace(loc.fileIndex, fileIndexIn(mFiles, sharedFileNames().name(loc.fileIndex), mFilesIndex)).first;
+            loc.fileIndex = it->second;
+        }
+
+        const bool mEnabled;
+        simplecpp::TokenList &mOutput;
+        std::vector<std::string> &mFiles;
+        simplecpp::FileIndex * const mFilesIndex;
+        simplecpp::OutputList * const mOutputList;
+        std::list<simplecpp::MacroUsage> * const mMacroUsage;
+        std::list<simplecpp::IfCond> * const mIfCond;
+        std::unordered_map<unsigned int, unsigned int> mIndexes;
+    };
+}
+
+/** Replace the builtin macro name with one expanding to value, unless it was defined by dui or in code */
+static void renewBuiltinMacro(simplecpp::MacroMap &macros, const std::string &name, const std::string &value, const simplecpp::DUI &dui, std::vector<std::string> &dummy)
 {
-#ifdef SIMPLECPP_WINDOWS
-    if (dui.clearIncludeCache)
-        nonExistingFilesCache.clear();
-#endif
+    const simplecpp::MacroMap::iterator it = macros.find(simplecpp::Atom(name));
+    if (it == macros.end() || it->second.valueDefinedInCode())
+        return;
+    for (const std::string &macrostr : dui.defines) {
+        if (macrostr.compare(0, macrostr.find_first_of("=("), name) == 0)
+            return;
+    }
+    it->second = simplecpp::Macro(name, value, dummy);
+}
+
+struct simplecpp::Prefix::State {
+    explicit State(const DUI &dui) : dui(dui), output(files) {}
+
+    bool matches(const DUI &other) const {
+        return dui.defines == other.defines && dui.undefined == other.undefined &&
+               dui.includePaths == other.includePaths && dui.includes == other.includes &&
+               dui.std == other.std && dui.removeComments == other.removeComments;
+    }
+
+    const DUI dui;
+    /** the macros refer to this empty file table, all locations are shared file indexes */
+    std::vector<std::string> files;
+    MacroMap macros;
+    std::stack<int> ifstates;
+    std::set<std::string> pragmaOnce;
+    std::map<std::string, std::list<Location>> maybeUsedMacros;
+    TokenList output;
+    OutputList outputList;
+    std::list<IfCond> ifCond;
+    bool complete{};
+};
+
+void simplecpp::Prefix::run(TokenList &output, const TokenList &rawtokens, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList, std::list<MacroUsage> *macroUsage, std::list<IfCond> *ifCond, const State *resume, State *capture)
+{
+    FileIndex * const filesIndex = fileIndexOf(rawtokens, files) ? fileIndexOf(rawtokens, files) : fileIndexOf(output, files);
+    const SharedLocationMapper sharedLocationMapper(cache.isConcurrent() || resume, output, files, filesIndex, outputList, macroUsage, ifCond);
+
+    if (dui.clearIncludeCache) {
+        includeResolutionCache.clear();
+        directoryCache.clear();
+    }
 
     std::map<std::string, std::size_t> sizeOfType(rawtokens.sizeOfType);
     sizeOfType.insert(std::make_pair("char", sizeof(char)));
@@ -3358,81 +5997,91 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
 
     const bool hasInclude = isCpp17OrLater(dui) || isGnu(dui);
     MacroMap macros;
-    bool strictAnsiDefined = false;
-    for (auto it = dui.defines.cbegin(); it != dui.defines.cend(); ++it) {
-        const std::string &macrostr = *it;
-        const std::string::size_type eq = macrostr.find('=');
-        const std::string::size_type par = macrostr.find('(');
-        const std::string macroname = macrostr.substr(0, std::min(eq,par));
-        if (macroname == "__STRICT_ANSI__")
-            strictAnsiDefined = true;
-        if (dui.undefined.find(macroname) != dui.undefined.end())
-            continue;
-        const std::string lhs(macrostr.substr(0,eq));
-        const std::string rhs(eq==std::string::npos ? std::string("1") : macrostr.substr(eq+1));
-        try {
-            const Macro macro(lhs, rhs, dummy);
-            macros.insert(std::pair<TokenString,Macro>(macro.name(), macro));
-        } catch (const std::runtime_error& e) {
-            if (outputList) {
-                simplecpp::Output err{
-                    Output::DUI_ERROR,
-                    {},
-                    e.what()
-                };
-                outputList->emplace_back(std::move(err));
-            }
-            output.clear();
-            return;
-        } catch (const simplecpp::Macro::Error& e) {
-            if (outputList) {
-                simplecpp::Output err{
-                    Output::DUI_ERROR,
-                    {},
-                    e.what
-                };
-                outputList->emplace_back(std::move(err));
-            }
-            output.clear();
-            return;
-        }
-    }
-
-    const bool strictAnsiUndefined = dui.undefined.find("__STRICT_ANSI__") != dui.undefined.cend();
-    if (!isGnu(dui) && !strictAnsiDefined && !strictAnsiUndefined)
-        macros.insert(std::pair<TokenString, Macro>("__STRICT_ANSI__", Macro("__STRICT_ANSI__", "1", dummy)));
-
-    macros.insert(std::make_pair("__FILE__", Macro("__FILE__", "__FILE__", dummy)));
-    macros.insert(std::make_pair("__LINE__", Macro("__LINE__", "__LINE__", dummy)));
-    macros.insert(std::make_pair("__COUNTER__", Macro("__COUNTER__", "__COUNTER__", dummy)));
-    struct tm ltime {};
-    getLocaltime(ltime);
-    macros.insert(std::make_pair("__DATE__", Macro("__DATE__", getDateDefine(&ltime), dummy)));
-    macros.insert(std::make_pair("__TIME__", Macro("__TIME__", getTimeDefine(&ltime), dummy)));
-
-    if (!dui.std.empty()) {
-        const cstd_t c_std = simplecpp::getCStd(dui.std);
-        if (c_std != CUnknown) {
-            const std::string std_def = simplecpp::getCStdString(c_std);
-            if (!std_def.empty())
-                macros.insert(std::make_pair("__STDC_VERSION__", Macro("__STDC_VERSION__", std_def, dummy)));
-        } else {
-            const cppstd_t cpp_std = simplecpp::getCppStd(dui.std);
-            if (cpp_std == CPPUnknown) {
+    if (resume) {
+        for (const auto &macro : resume->macros)
+            macros.insert(macro);
+        // the builtin date and time are those of this run, not of the prefix
+        struct tm ltime {};
+        getLocaltime(ltime);
+        renewBuiltinMacro(macros, "__DATE__", getDateDefine(&ltime), dui, dummy);
+        renewBuiltinMacro(macros, "__TIME__", getTimeDefine(&ltime), dui, dummy);
+    } else {
+        bool strictAnsiDefined = false;
+        for (auto it = dui.defines.cbegin(); it != dui.defines.cend(); ++it) {
+            const std::string &macrostr = *it;
+            const std::string::size_type eq = macrostr.find('=');
+            const std::string::size_type par = macrostr.find('(');
+            const std::string macroname = macrostr.substr(0, std::min(eq,par));
+            if (macroname == "__STRICT_ANSI__")
+                strictAnsiDefined = true;
+            if (dui.undefined.find(macroname) != dui.undefined.end())
+                continue;
+            const std::string lhs(macrostr.substr(0,eq));
+            const std::string rhs(eq==std::string::npos ? std::string("1") : macrostr.substr(eq+1));
+            try {
+                const Macro macro(lhs, rhs, dummy);
+                macros.insert(std::make_pair(macro.nameAtom(), macro));
+            } catch (const std::runtime_error& e) {
+                if (outputList) {
+                    simplecpp::Output err{
+                        Output::DUI_ERROR,
+                        {},
+                        e.what()
+                    };
+                    outputList->emplace_back(std::move(err));
+                }
+                output.clear();
+                return;
+            } catch (const simplecpp::Macro::Error& e) {
                 if (outputList) {
                     simplecpp::Output err{
                         Output::DUI_ERROR,
                         {},
-                        "unknown standard specified: '" + dui.std + "'"
+                        e.what
                     };
                     outputList->emplace_back(std::move(err));
                 }
                 output.clear();
                 return;
             }
-            const std::string std_def = simplecpp::getCppStdString(cpp_std);
-            if (!std_def.empty())
-                macros.insert(std::make_pair("__cplusplus", Macro("__cplusplus", std_def, dummy)));
+        }
+
+        const bool strictAnsiUndefined = dui.undefined.find("__STRICT_ANSI__") != dui.undefined.cend();
+        if (!isGnu(dui) && !strictAnsiDefined && !strictAnsiUndefined)
+            macros.insert(std::pair<TokenString, Macro>("__STRICT_ANSI__", Macro("__STRICT_ANSI__", "1", dummy)));
+
+        macros.insert(std::make_pair("__FILE__", Macro("__FILE__", "__FILE__", dummy)));
+        macros.insert(std::make_pair("__LINE__", Macro("__LINE__", "__LINE__", dummy)));
+        macros.insert(std::make_pair("__COUNTER__", Macro("__COUNTER__", "__COUNTER__", dummy)));
+        struct tm ltime {};
+        getLocaltime(ltime);
+        macros.insert(std::make_pair("__DATE__", Macro("__DATE__", getDateDefine(&ltime), dummy)));
+        macros.insert(std::make_pair("__TIME__", Macro("__TIME__", getTimeDefine(&ltime), dummy)));
+
+        if (!dui.std.empty()) {
+            const cstd_t c_std = simplecpp::getCStd(dui.std);
+            if (c_std != CUnknown) {
+                const std::string std_def = simplecpp::getCStdString(c_std);
+                if (!std_def.empty())
+                    macros.insert(std::make_pair("__STDC_VERSION__", Macro("__STDC_VERSION__", std_def, dummy)));
+            } else {
+                const cppstd_t cpp_std = simplecpp::getCppStd(dui.std);
+                if (cpp_std == CPPUnknown) {
+                    if (outputList) {
+                        simplecpp::Output err{
+                            Output::DUI_ERROR,
+                            {},
+                            "unknown standard specified: '" + dui.std + "'"
+                        };
+                        outputList->emplace_back(std::move(err));
+                    }
+                    output.clear();
+                    return;
+                }
+                const std::string std_def = simplecpp::getCppStdString(cpp_std);
+                if (!std_def.empty())
+                    macros.insert(std::make_pair("__cplusplus", Macro("__cplusplus", std_def, dummy)));
+            }
         }
     }
 
@@ -3441,25 +6090,51 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
     // AlwaysFalse => drop all code in #if and #else
     enum IfState : std::uint8_t { True, ElseIsTrue, AlwaysFalse };
     std::stack<int> ifstates;
-    std::stack<const Token *> iftokens;
-    ifstates.push(True);
+    if (resume)
+        ifstates = resume->ifstates;
+    else
+        ifstates.push(True);
 
-    std::stack<const Token *> includetokenstack;
+    // where to continue once the current file is done, and the directives of that file
+    std::stack<std::pair<const Token *, const DirectiveIndex *>> includetokenstack;
+    const DirectiveIndex rawdirectives(rawtokens);
+    const DirectiveIndex *directives = nullptr;
 
     std::set<std::string> pragmaOnce;
 
-    includetokenstack.push(rawtokens.cfront());
-    for (auto it = dui.includes.cbegin(); it != dui.includes.cend(); ++it) {
-        const FileData *const filedata = cache.get("", *it, dui, false, files, outputList).first;
-        if (filedata != nullptr && filedata->tokens.cfront() != nullptr)
-            includetokenstack.push(filedata->tokens.cfront());
+    const std::unique_ptr<FileDataCache::Prefetcher> prefetcher = FileDataCache::Prefetcher::create(cache, dui, rawtokens, !resume, outputList != nullptr);
+    const auto getFile = [&](const std::string &sourcefile, const std::string &header, bool systemheader) {
+        if (prefetcher)
+            return prefetcher->get(sourcefile, header, systemheader, files, outputList, filesIndex);
+        return cache.get(sourcefile, header, dui, systemheader, files, outputList, filesIndex);
+    };
+
+    includetokenstack.emplace(rawtokens.cfront(), &rawdirectives);
+    if (!resume) {
+        for (auto it = dui.includes.cbegin(); it != dui.includes.cend(); ++it) {
+            const FileData *const filedata = getFile("", *it, false).first;
+            if (filedata != nullptr && filedata->tokens.cfront() != nullptr)
+                includetokenstack.emplace(filedata->tokens.cfront(), &filedata->directives);
+        }
     }
 
     std::map<std::string, std::list<Location>> maybeUsedMacros;
 
+    if (resume) {
+        pragmaOnce = resume->pragmaOnce;
+        maybeUsedMacros = resume->maybeUsedMacros;
+        for (const Token *tok = resume->output.cfront(); tok; tok = tok->next)
+            output.push_back(new Token(*tok));
+        if (outputList)
+            outputList->insert(outputList->end(), resume->outputList.cbegin(), resume->outputList.cend());
+        if (ifCond)
+            ifCond->insert(ifCond->end(), resume->ifCond.cbegin(), resume->ifCond.cend());
+    }
+
     for (const Token *rawtok = nullptr; rawtok || !includetokenstack.empty();) {
         if (rawtok == nullptr) {
-            rawtok = includetokenstack.top();
+            rawtok = includetokenstack.top().first;
+            directives = includetokenstack.top().second;
             includetokenstack.pop();
             continue;
         }
@@ -3469,13 +6144,14 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 rawtok = rawtok->next;
                 continue;
             }
+            const Token * const hashtok = rawtok;
             rawtok = rawtok->next;
             if (!rawtok->name) {
                 rawtok = gotoNextLine(rawtok);
                 continue;
             }
 
-            if (ifstates.size() <= 1U && (rawtok->str() == ELIF || rawtok->str() == ELSE || rawtok->str() == ENDIF)) {
+            if (ifstates.size() <= 1U && (rawtok->atom() == ELIF || rawtok->atom() == ELSE || rawtok->atom() == ENDIF)) {
                 if (outputList) {
                     simplecpp::Output err{
                         Output::SYNTAX_ERROR,
@@ -3488,7 +6164,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 return;
             }
 
-            if (ifstates.top() == True && (rawtok->str() == ERROR || rawtok->str() == WARNING)) {
+            if (ifstates.top() == True && (rawtok->atom() == ERROR || rawtok->atom() == WARNING)) {
                 if (outputList) {
                     std::string msg;
                     for (const Token *tok = rawtok->next; tok && sameline(rawtok,tok); tok = tok->next) {
@@ -3498,28 +6174,26 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                     }
                     msg = '#' + rawtok->str() + ' ' + msg;
                     simplecpp::Output err{
-                        rawtok->str() == ERROR ? Output::ERROR : Output::WARNING,
+                        rawtok->atom() == ERROR ? Output::ERROR : Output::WARNING,
                         rawtok->location,
                         std::move(msg)
                     };
 
                     outputList->emplace_back(std::move(err));
                 }
-                if (rawtok->str() == ERROR) {
+                if (rawtok->atom() == ERROR) {
                     output.clear();
                     return;
                 }
             }
 
-            if (rawtok->str() == DEFINE) {
-                if (ifstates.top() != True)
-                    continue;
+            if (ifstates.top() == True && rawtok->atom() == DEFINE) {
                 try {
                     const Macro &macro = Macro(rawtok->previous, files);
                     if (dui.undefined.find(macro.name()) == dui.undefined.end()) {
-                        const MacroMap::iterator it = macros.find(macro.name());
+                        const MacroMap::iterator it = macros.find(macro.nameAtom());
                         if (it == macros.end())
-                            macros.insert(std::pair<TokenString, Macro>(macro.name(), macro));
+                            macros.insert(std::make_pair(macro.nameAtom(), macro));
                         else
                             it->second = macro;
                     }
@@ -3546,7 +6220,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                     output.clear();
                     return;
                 }
-            } else if (ifstates.top() == True && rawtok->str() == INCLUDE) {
+            } else if (ifstates.top() == True && rawtok->atom() == INCLUDE) {
                 TokenList inc1(files);
                 for (const Token *inctok = rawtok->next; sameline(rawtok,inctok); inctok = inctok->next) {
                     if (!inctok->comment)
@@ -3592,7 +6266,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
 
                 const bool systemheader = (inctok->str()[0] == '<');
                 const std::string header(inctok->str().substr(1U, inctok->str().size() - 2U));
-                const FileData *const filedata = cache.get(rawtokens.file(rawtok->location), header, dui, systemheader, files, outputList).first;
+                const FileData *const filedata = getFile(rawtokens.file(rawtok->location), header, systemheader).first;
                 if (filedata == nullptr) {
                     if (outputList) {
                         simplecpp::Output out{
@@ -3612,11 +6286,18 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                         outputList->emplace_back(std::move(out));
                     }
                 } else if (pragmaOnce.find(filedata->filename) == pragmaOnce.end()) {
-                    includetokenstack.push(gotoNextLine(rawtok));
-                    rawtok = filedata->tokens.cfront();
-                    continue;
+                    if (!filedata->includeGuard.empty() && macros.find(filedata->includeGuard) != macros.end()) {
+                        // the guard is still defined so the file would produce nothing; only record the guard check
+                        const Token * const guardtok = ifndefNameToken(filedata->tokens);
+                        maybeUsedMacros[guardtok->str()].emplace_back(guardtok->location);
+                    } else {
+                        includetokenstack.emplace(gotoNextLine(rawtok), directives);
+                        rawtok = filedata->tokens.cfront();
+                        directives = &filedata->directives;
+                        continue;
+                    }
                 }
-            } else if (rawtok->str() == IF || rawtok->str() == IFDEF || rawtok->str() == IFNDEF || rawtok->str() == ELIF) {
+            } else if (rawtok->atom() == IF || rawtok->atom() == IFDEF || rawtok->atom() == IFNDEF || rawtok->atom() == ELIF) {
                 if (!sameline(rawtok,rawtok->next)) {
                     if (outputList) {
                         simplecpp::Output out{
@@ -3631,16 +6312,19 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 }
 
                 bool conditionIsTrue;
-                if (ifstates.top() == AlwaysFalse || (ifstates.top() == ElseIsTrue && rawtok->str() != ELIF)) {
+                long long conditionResult;
+                if (ifstates.top() == AlwaysFalse || (ifstates.top() == ElseIsTrue && rawtok->atom() != ELIF)) {
                     conditionIsTrue = false;
                 }
-                else if (rawtok->str() == IFDEF) {
-                    conditionIsTrue = (macros.find(rawtok->next->str()) != macros.end() || (hasInclude && rawtok->next->str() == HAS_INCLUDE));
+                else if (rawtok->atom() == IFDEF) {
+                    conditionIsTrue = (macros.find(rawtok->next->atom()) != macros.end() || (hasInclude && rawtok->next->atom() == HAS_INCLUDE));
                     maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
-                } else if (rawtok->str() == IFNDEF) {
-                    conditionIsTrue = (macros.find(rawtok->next->str()) == macros.end() && !(hasInclude && rawtok->next->str() == HAS_INCLUDE));
+                } else if (rawtok->atom() == IFNDEF) {
+                    conditionIsTrue = (macros.find(rawtok->next->atom()) == macros.end() && !(hasInclude && rawtok->next->atom() == HAS_INCLUDE));
                     maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
-                } else { /*if (rawtok->str() == IF || rawtok->str() == ELIF)*/
+                } else if (evaluateCondition(directives->condition(hashtok), rawtok, macros, hasInclude, maybeUsedMacros, ifCond, conditionResult)) {
+                    conditionIsTrue = (conditionResult != 0);
+                } else { /*if (rawtok->atom() == IF || rawtok->atom() == ELIF)*/
                     TokenList expr(files);
                     for (const Token *tok = rawtok->next; tok && tok->location.sameline(rawtok->location); tok = tok->next) {
                         if (!tok->name) {
@@ -3648,16 +6332,16 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                             continue;
                         }
 
-                        if (tok->str() == DEFINED) {
+                        if (tok->atom() == DEFINED) {
                             tok = tok->next;
                             const bool par = (tok && tok->op == '(');
                             if (par)
                                 tok = tok->next;
                             maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
                             if (tok) {
-                                if (macros.find(tok->str()) != macros.end())
+                                if (macros.find(tok->atom()) != macros.end())
                                     expr.push_back(new Token("1", tok->location));
-                                else if (hasInclude && tok->str() == HAS_INCLUDE)
+                                else if (hasInclude && tok->atom() == HAS_INCLUDE)
                                     expr.push_back(new Token("1", tok->location));
                                 else
                                     expr.push_back(new Token("0", tok->location));
@@ -3669,7 +6353,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                                     Output out{
                                         Output::SYNTAX_ERROR,
                                         rawtok->location,
-                                        "failed to evaluate " + std::string(rawtok->str() == IF ? "#if" : "#elif") + " condition"
+                                        "failed to evaluate " + std::string(rawtok->atom() == IF ? "#if" : "#elif") + " condition"
                                     };
                                     outputList->emplace_back(std::move(out));
                                 }
@@ -3679,7 +6363,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                             continue;
                         }
 
-                        if (hasInclude && tok->str() == HAS_INCLUDE) {
+                        if (hasInclude && tok->atom() == HAS_INCLUDE) {
                             tok = tok->next;
                             const bool par = (tok && tok->op == '(');
                             if (par)
@@ -3699,11 +6383,8 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                                     header = tok->str().substr(1U, tok->str().size() - 2U);
                                     closingAngularBracket = true;
                                 }
-                                if (tok) {
-                                    std::ifstream f;
-                                    const std::string header2 = openHeader(f,dui,sourcefile,header,systemheader);
-                                    expr.push_back(new Token(header2.empty() ? "0" : "1", tok->location));
-                                }
+                                if (tok)
+                                    expr.push_back(new Token(hasHeader(dui, sourcefile, header, systemheader) ? "1" : "0", tok->location));
                             }
                             if (par)
                                 tok = tok ? tok->next : nullptr;
@@ -3712,7 +6393,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                                     Output out{
                                         Output::SYNTAX_ERROR,
                                         rawtok->location,
-                                        "failed to evaluate " + std::string(rawtok->str() == IF ? "#if" : "#elif") + " condition"
+                                        "failed to evaluate " + std::string(rawtok->atom() == IF ? "#if" : "#elif") + " condition"
                                     };
                                     outputList->emplace_back(std::move(out));
                                 }
@@ -3747,7 +6428,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                         }
                     } catch (const std::runtime_error &e) {
                         if (outputList) {
-                            std::string msg = "failed to evaluate " + std::string(rawtok->str() == IF ? "#if" : "#elif") + " condition";
+                            std::string msg = "failed to evaluate " + std::string(rawtok->atom() == IF ? "#if" : "#elif") + " condition";
                             if (e.what() && *e.what())
                                 msg += std::string(", ") + e.what();
                             Output out{
@@ -3762,42 +6443,35 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                     }
                 }
 
-                if (rawtok->str() != ELIF) {
+                if (rawtok->atom() != ELIF) {
                     // push a new ifstate..
                     if (ifstates.top() != True)
                         ifstates.push(AlwaysFalse);
                     else
                         ifstates.push(conditionIsTrue ? True : ElseIsTrue);
-                    iftokens.push(rawtok);
                 } else {
                     if (ifstates.top() == True)
                         ifstates.top() = AlwaysFalse;
                     else if (ifstates.top() == ElseIsTrue && conditionIsTrue)
                         ifstates.top() = True;
-                    iftokens.top()->nextcond = rawtok;
-                    iftokens.top() = rawtok;
                 }
-            } else if (rawtok->str() == ELSE) {
+            } else if (rawtok->atom() == ELSE) {
                 ifstates.top() = (ifstates.top() == ElseIsTrue) ? True : AlwaysFalse;
-                iftokens.top()->nextcond = rawtok;
-                iftokens.top() = rawtok;
-            } else if (rawtok->str() == ENDIF) {
+            } else if (rawtok->atom() == ENDIF) {
                 ifstates.pop();
-                iftokens.top()->nextcond = rawtok;
-                iftokens.pop();
-            } else if (rawtok->str() == UNDEF) {
+            } else if (rawtok->atom() == UNDEF) {
                 if (ifstates.top() == True) {
                     const Token *tok = rawtok->next;
                     while (sameline(rawtok,tok) && tok->comment)
                         tok = tok->next;
                     if (sameline(rawtok, tok))
-                        macros.erase(tok->str());
+                        macros.erase(tok->atom());
                 }
-            } else if (ifstates.top() == True && rawtok->str() == PRAGMA && rawtok->next && rawtok->next->str() == ONCE && sameline(rawtok,rawtok->next)) {
+            } else if (ifstates.top() == True && rawtok->atom() == PRAGMA && rawtok->next && rawtok->next->atom() == ONCE && sameline(rawtok,rawtok->next)) {
                 pragmaOnce.insert(rawtokens.file(rawtok->location));
             }
-            if (ifstates.top() != True && rawtok->nextcond)
-                rawtok = rawtok->nextcond->previous;
+            if (ifstates.top() != True)
+                rawtok = directives->skip(hashtok);
             else
                 rawtok = gotoNextLine(rawtok);
             continue;
@@ -3843,6 +6517,19 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
         }
     }
 
+    if (capture) {
+        for (const auto &macro : macros)
+            capture->macros.insert(std::make_pair(macro.first, Macro(macro.second, capture->files, files)));
+        capture->ifstates = ifstates;
+        capture->pragmaOnce = pragmaOnce;
+        capture->maybeUsedMacros = maybeUsedMacros;
+        for (auto &usage : capture->maybeUsedMacros) {
+            for (Location &loc : usage.second)
+                shareLocation(loc, files);
+        }
+        capture->complete = true;
+    }
+
     if (macroUsage) {
         for (simplecpp::MacroMap::const_iterator macroIt = macros.begin(); macroIt != macros.end(); ++macroIt) {
             const Macro &macro = macroIt->second;
@@ -3860,11 +6547,84 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
     }
 }
 
+void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenList &rawtokens, std::vector<std::string> &files, simplecpp::FileDataCache &cache, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
+{
+    Prefix::run(output, rawtokens, files, cache, dui, outputList, macroUsage, ifCond, nullptr, nullptr);
+}
+
+void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenList &rawtokens, std::vector<std::string> &files, simplecpp::FileDataCache &cache, const simplecpp::DUI &dui, const simplecpp::Prefix &prefix, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
+{
+    const Prefix::State * const resume = (prefix.mState && prefix.mState->matches(dui)) ? prefix.mState.get() : nullptr;
+    Prefix::run(output, rawtokens, files, cache, dui, outputList, macroUsage, ifCond, resume, nullptr);
+}
+
+simplecpp::Prefix::Prefix(std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList)
+{
+    std::unique_ptr<State> state(new State(dui));
+    const TokenList rawtokens(files);
+    TokenList output(files);
+    OutputList messages;
+    run(output, rawtokens, files, cache, dui, &messages, nullptr, &state->ifCond, nullptr, state.get());
+
+    if (outputList)
+        outputList->insert(outputList->end(), messages.cbegin(), messages.cend());
+    if (!state->complete)
+        return;
+
+    // the snapshot must not depend on the caller's files
+    for (const Token *tok = output.cfront(); tok; tok = tok->next) {
+        Token * const copy = new Token(*tok);
+        shareLocation(copy->location, files);
+        state->output.push_back(copy);
+    }
+    for (Output &msg : messages) {
+        shareLocation(msg.location, files);
+        state->outputList.emplace_back(std::move(msg));
+    }
+    for (IfCond &cond : state->ifCond)
+        shareLocation(cond.location, files);
+    mState = std::move(state);
+}
+
+simplecpp::Prefix::~Prefix() = default;
+
 void simplecpp::cleanup(FileDataCache &cache)
 {
     cache.clear();
 }
 
+simplecpp::Context::Context()
+    : mFileIndex(mFiles)
+    , mCache(std::make_shared<FileDataCache>())
+{}
+
+simplecpp::Context::Context(std::shared_ptr<FileDataCache> cache)
+    : mFileIndex(mFiles)
+    , mCache(std::move(cache))
+{}
+
+simplecpp::TokenList simplecpp::Context::tokenize(const std::string &filename, OutputList *outputList, TokenList::FileInput input)
+{
+    return {filename, mFiles, outputList, input, &mFileIndex};
+}
+
+simplecpp::TokenList simplecpp::Context::tokenize(std::istream &istr, const std::string &filename, OutputList *outputList)
+{
+    return {istr, mFiles, filename, outputList, &mFileIndex};
+}
+
+void simplecpp::Context::load(const TokenList &rawtokens, const DUI &dui, OutputList *outputList)
+{
+    loadIncludes(rawtokens, mFiles, &mFileIndex, dui, outputList, *mCache);
+}
+
+simplecpp::TokenList simplecpp::Context::preprocess(const TokenList &rawtokens, const DUI &dui, OutputList *outputList, std::list<MacroUsage> *macroUsage, std::list<IfCond> *ifCond)
+{
+    TokenList output(mFiles, &mFileIndex);
+    simplecpp::preprocess(output, rawtokens, mFiles, *mCache, dui, outputList, macroUsage, ifCond);
+    return output;
+}
+
 simplecpp::cstd_t simplecpp::getCStd(const std::string &std)
 {
     if (std == "c90" || std == "c89" || std == "iso9899:1990" || std == "iso9899:199409" || std == "gnu90" || std == "gnu89")
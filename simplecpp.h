@@ -6,6 +6,7 @@
 #ifndef simplecppH
 #define simplecppH
 
+#include <atomic>
 #include <cctype>
 #include <cstdint>
 #include <cstring>
@@ -63,6 +64,21 @@
 #  endif
 #endif
 
+// allocate tokens from a per-thread pool
+// note: the pool hides token leaks and use-after-free from AddressSanitizer and valgrind
+#ifndef SIMPLECPP_TOKEN_POOL
+#  if defined(__SANITIZE_ADDRESS__)
+#    define SIMPLECPP_TOKEN_POOL 0
+#  elif defined(__has_feature)
+#    if __has_feature(address_sanitizer)
+#      define SIMPLECPP_TOKEN_POOL 0
+#    endif
+#  endif
+#  ifndef SIMPLECPP_TOKEN_POOL
+#    define SIMPLECPP_TOKEN_POOL 1
+#  endif
+#endif
+
 namespace simplecpp {
     /** C code standard */
     enum cstd_t : std::int8_t { CUnknown=-1, C89, C99, C11, C17, C23, C2Y };
@@ -113,6 +129,83 @@ namespace simplecpp {
 
     class Macro;
 
+    /**
+     * Interned string. Short strings (names, numbers, operators) are stored
+     * once per process, so copying and comparing them is a pointer operation.
+     * Longer strings (comments, long literals) are shared by reference count.
+     */
+    class SIMPLECPP_LIB Atom {
+    public:
+        Atom() : mEntry(emptyEntry()) {}
+        explicit Atom(const std::string &s);
+        Atom(const Atom &other) : mEntry(other.mEntry) {
+            if (!mEntry->interned)
+                ++mEntry->refs;
+        }
+        Atom &operator=(const Atom &other) {
+            if (!other.mEntry->interned)
+                ++other.mEntry->refs;
+            release();
+            mEntry = other.mEntry;
+            return *this;
+        }
+        ~Atom() {
+            release();
+        }
+
+        const std::string &str() const {
+            return mEntry->str;
+        }
+        // cppcheck-suppress noExplicitConstructor
+        operator const std::string &() const { // NOLINT(google-explicit-constructor)
+            return mEntry->str;
+        }
+        bool empty() const {
+            return mEntry->str.empty();
+        }
+        std::size_t hash() const {
+            return mEntry->hash;
+        }
+
+        bool operator==(const Atom &other) const {
+            // equal short strings always share the same entry
+            return mEntry == other.mEntry || (!mEntry->interned && !other.mEntry->interned && mEntry->str == other.mEntry->str);
+        }
+        bool operator!=(const Atom &other) const {
+            return !(*this == other);
+        }
+        bool operator==(const std::string &s) const {
+            return mEntry->str == s;
+        }
+        bool operator!=(const std::string &s) const {
+            return mEntry->str != s;
+        }
+
+        struct Hasher {
+            std::size_t operator()(const Atom &atom) const {
+                return atom.hash();
+            }
+        };
+
+        struct Entry {
+            Entry(const std::string &s, std::size_t h, bool i) : str(s), hash(h), interned(i) {}
+            const std::string str;
+            const std::size_t hash;
+            const bool interned;
+            mutable std::atomic<unsigned int> refs{1};
+        };
+
+    private:
+        static const Entry *emptyEntry();
+
+        void release() {
+            if (!mEntry->interned && --mEntry->refs == 0)
+                delete mEntry;
+        }
+
+        const Entry *mEntry;
+    };
+
     /**
      * Location in source code
      */
@@ -149,7 +242,6 @@ namespace simplecpp {
 
     /**
      * token class.
-     * @todo don't use std::string representation - for both memory and performance reasons
      */
     class SIMPLECPP_LIB Token {
     public:
@@ -158,15 +250,33 @@ namespace simplecpp {
             flags();
         }
 
+        Token(const Atom &s, const Location &loc, bool wsahead = false) :
+            whitespaceahead(wsahead), location(loc), string(s) {
+            flags();
+        }
+
         Token(const Token &tok) :
             macro(tok.macro), op(tok.op), comment(tok.comment), name(tok.name), number(tok.number), whitespaceahead(tok.whitespaceahead), location(tok.location), string(tok.string), mExpandedFrom(tok.mExpandedFrom) {}
 
         Token &operator=(const Token &tok) = delete;
 
+#if SIMPLECPP_TOKEN_POOL
+        /** tokens are allocated from a per-thread pool */
+        static void *operator new(std::size_t size);
+        static void operator delete(void *p, std::size_t size);
+#endif
+
         const TokenString& str() const {
+            return string.str();
+        }
+        const Atom& atom() const {
             return string;
         }
         void setstr(const std::string &s) {
+            string = Atom(s);
+            flags();
+        }
+        void setstr(const Atom &s) {
             string = s;
             flags();
         }
@@ -179,7 +289,8 @@ namespace simplecpp {
                    (s.size() > 1U && (s[0] == '-' || s[0] == '+') && std::isdigit(static_cast<unsigned char>(s[1])));
         }
 
-        TokenString macro;
+        /** name of the macro this token was expanded from */
+        Atom macro;
         char op;
         bool comment;
         bool name;
@@ -188,7 +299,6 @@ namespace simplecpp {
         Location location;
         Token *previous{};
         Token *next{};
-        mutable const Token *nextcond{};
 
         const Token *previousSkipComments() const {
             const Token *tok = this->previous;
@@ -205,34 +315,41 @@ namespace simplecpp {
         }
 
         void setExpandedFrom(const Token *tok, const Macro* m) {
-            mExpandedFrom = tok->mExpandedFrom;
-            mExpandedFrom.insert(m);
+            mExpandedFrom = withMacro(tok->mExpandedFrom, m);
             if (tok->whitespaceahead)
                 whitespaceahead = true;
         }
-        bool isExpandedFrom(const Macro* m) const {
-            return mExpandedFrom.find(m) != mExpandedFrom.end();
-        }
+        bool isExpandedFrom(const Macro* m) const;
         void markExpandedFrom(const Macro* m) {
-            mExpandedFrom.insert(m);
+            mExpandedFrom = withMacro(mExpandedFrom, m);
         }
 
         void printAll() const;
         void printOut() const;
     private:
         void flags() {
-            name = (std::isalpha(static_cast<unsigned char>(string[0])) || string[0] == '_' || string[0] == '$')
-                   && (std::memchr(string.c_str(), '\'', string.size()) == nullptr);
-            comment = string.size() > 1U && string[0] == '/' && (string[1] == '/' || string[1] == '*');
-            number = isNumberLike(string);
-            op = (string.size() == 1U && !name && !comment && !number) ? string[0] : '\0';
+            const std::string &s = string.str();
+            name = (std::isalpha(static_cast<unsigned char>(s[0])) || s[0] == '_' || s[0] == '$')
+                   && (std::memchr(s.c_str(), '\'', s.size()) == nullptr);
+            comment = s.size() > 1U && s[0] == '/' && (s[1] == '/' || s[1] == '*');
+            number = isNumberLike(s);
+            op = (s.size() == 1U && !name && !comment && !number) ? s[0] : '\0';
         }
 
-        TokenString string;
+        Atom string;
 
-        std::set<const Macro*> mExpandedFrom;
+        /** sorted set of macros, shared between tokens and never modified */
+        using MacroSet = std::shared_ptr<const std::vector<const Macro*>>;
+        static MacroSet withMacro(const MacroSet &macros, const Macro *m);
+
+        MacroSet mExpandedFrom;
     };
 
+#if SIMPLECPP_TOKEN_POOL && defined(SIMPLECPP_TOKEN_POOL_STATS)
+    /** Number of tokens the token pools have allocated from the system (for testing) */
+    SIMPLECPP_LIB std::size_t tokenPoolCapacity();
+#endif
+
     /** Output from preprocessor */
     struct SIMPLECPP_LIB Output {
         enum Type : std::uint8_t {
@@ -254,52 +371,98 @@ namespace simplecpp {
 
     using OutputList = std::list<Output>;
 
+    /**
+     * Hash index over a file table, the files vector that Location::fileIndex
+     * refers to. Token lists constructed with it, and preprocess() and load()
+     * of such token lists, look files up in O(1) instead of searching the
+     * vector linearly. Entries may be appended to the vector by anyone.
+     * The index is rebuilt when the vector is reallocated or shrunk, or when
+     * a lookup finds that its hit, or the first or last indexed entry, no
+     * longer matches; other changes of entries in place are not supported.
+     */
+    class SIMPLECPP_LIB FileIndex {
+    public:
+        explicit FileIndex(std::vector<std::string> &files);
+
+        FileIndex(const FileIndex &) = delete;
+        FileIndex &operator=(const FileIndex &) = delete;
+
+        /** Index of filename, it is appended to the files if missing */
+        unsigned int get(const std::string &filename);
+
+        /** Look up filename, returns false if it is not in the files */
+        bool find(const std::string &filename, unsigned int &index);
+
+        /** The indexed files */
+        std::vector<std::string> &files() const {
+            return mFiles;
+        }
+
+    private:
+        void update();
+        void rebuild();
+        bool indexed(const std::string &filename) const;
+
+        std::vector<std::string> &mFiles;
+        std::unordered_map<std::string, unsigned int> mIndexes;
+        std::size_t mIndexed{};
+        /** data() of the files when they were indexed */
+        const std::string *mData{};
+    };
+
     /** List of tokens. */
     class SIMPLECPP_LIB TokenList {
     public:
         class Stream;
 
-        explicit TokenList(std::vector<std::string> &filenames);
+        /** how TokenList(filename, ...) reads the file */
+        enum class FileInput : std::uint8_t {
+            Mapped, /**< memory map regular files, read other files into memory at once */
+            Stdio   /**< read the file character by character with stdio */
+        };
+
+        /** filesIndex, if given, indexes filenames */
+        explicit TokenList(std::vector<std::string> &filenames, FileIndex *filesIndex = nullptr);
         /** generates a token list from the given std::istream parameter */
-        TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr);
+        TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr);
         /** generates a token list from the given buffer */
         template<size_t size>
-        TokenList(const char (&data)[size], std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
-            : TokenList(reinterpret_cast<const unsigned char*>(data), size-1, filenames, filename, outputList, 0)
+        TokenList(const char (&data)[size], std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr)
+            : TokenList(reinterpret_cast<const unsigned char*>(data), size-1, filenames, filename, outputList, filesIndex, 0)
         {}
         /** generates a token list from the given buffer */
         template<size_t size>
-        TokenList(const unsigned char (&data)[size], std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
-            : TokenList(data, size-1, filenames, filename, outputList, 0)
+        TokenList(const unsigned char (&data)[size], std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr)
+            : TokenList(data, size-1, filenames, filename, outputList, filesIndex, 0)
         {}
 #if SIMPLECPP_TOKENLIST_ALLOW_PTR
         /** generates a token list from the given buffer */
-        TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
-            : TokenList(data, size, filenames, filename, outputList, 0)
+        TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr)
+            : TokenList(data, size, filenames, filename, outputList, filesIndex, 0)
         {}
         /** generates a token list from the given buffer */
-        TokenList(const char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
-            : TokenList(reinterpret_cast<const unsigned char*>(data), size, filenames, filename, outputList, 0)
+        TokenList(const char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr)
+            : TokenList(reinterpret_cast<const unsigned char*>(data), size, filenames, filename, outputList, filesIndex, 0)
         {}
 #endif // SIMPLECPP_TOKENLIST_ALLOW_PTR
         /** generates a token list from the given buffer */
-        TokenList(View data, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
-            : TokenList(reinterpret_cast<const unsigned char*>(data.data()), data.size(), filenames, filename, outputList, 0)
+        TokenList(View data, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr)
+            : TokenList(reinterpret_cast<const unsigned char*>(data.data()), data.size(), filenames, filename, outputList, filesIndex, 0)
         {}
 #ifdef __cpp_lib_span
         /** generates a token list from the given buffer */
-        TokenList(std::span<const char> data, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
-            : TokenList(reinterpret_cast<const unsigned char*>(data.data()), data.size(), filenames, filename, outputList, 0)
+        TokenList(std::span<const char> data, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr)
+            : TokenList(reinterpret_cast<const unsigned char*>(data.data()), data.size(), filenames, filename, outputList, filesIndex, 0)
         {}
 
         /** generates a token list from the given buffer */
-        TokenList(std::span<const unsigned char> data, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
-            : TokenList(data.data(), data.size(), filenames, filename, outputList, 0)
+        TokenList(std::span<const unsigned char> data, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, FileIndex *filesIndex = nullptr)
+            : TokenList(data.data(), data.size(), filenames, filename, outputList, filesIndex, 0)
         {}
 #endif // __cpp_lib_span
 
         /** generates a token list from the given filename parameter */
-        TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList = nullptr);
+        TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList = nullptr, FileInput input = FileInput::Mapped, FileIndex *filesIndex = nullptr);
         TokenList(const TokenList &other);
         TokenList(TokenList &&other);
         ~TokenList();
@@ -315,6 +478,20 @@ namespace simplecpp {
         void dump(bool linenrs = false) const;
         std::string stringify(bool linenrs = false) const;
 
+        /**
+         * Versioned binary form of the tokens: the files and strings they
+         * use, and per token its string, whitespace flag and delta encoded
+         * location. It can be loaded without lexing.
+         */
+        std::string serialize() const;
+        /**
+         * Append the tokens of data written by serialize(), adding their
+         * files to this list's files. The tokens are read directly from
+         * data, which may be a memory mapped file.
+         * @return false without changing the list if data is invalid
+         */
+        bool deserialize(const char *data, std::size_t size);
+
         void readfile(Stream &stream, const std::string &filename=std::string(), OutputList *outputList = nullptr);
         /**
          * @throws std::overflow_error thrown on overflow or division by zero
@@ -376,10 +553,15 @@ namespace simplecpp {
             return files;
         }
 
+        /** The index of the files, nullptr if there is none */
+        FileIndex *getFileIndex() const {
+            return filesIndex;
+        }
+
         const std::string& file(const Location& loc) const;
 
     private:
-        TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, int /*unused*/);
+        TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, FileIndex *filesIndex, int /*unused*/);
 
         void combineOperators();
 
@@ -398,7 +580,13 @@ namespace simplecpp {
          */
         void constFoldQuestionOp(Token *&tok1);
 
-        std::string readUntil(Stream &stream, const Location &location, char start, char end, OutputList *outputList);
+        /** tokenize input that is already in memory, UTF-16 input is converted to single bytes first */
+        void readbuffer(const unsigned char *data, std::size_t size, const std::string &filename, OutputList *outputList);
+        /** tokenize input from a Stream or from a non-virtual reader for in-memory input */
+        template<class Reader>
+        void tokenize(Reader &stream, const std::string &filename, OutputList *outputList);
+        template<class Reader>
+        std::string readUntil(Reader &stream, const Location &location, char start, char end, OutputList *outputList);
         void lineDirective(unsigned int fileIndex_, unsigned int line, Location &location);
 
         const Token* lastLineTok(int maxsize=1000) const;
@@ -409,6 +597,7 @@ namespace simplecpp {
         Token *frontToken;
         Token *backToken;
         std::vector<std::string> &files;
+        FileIndex *filesIndex;
     };
 
     /** Tracking how macros are used */
@@ -439,15 +628,70 @@ namespace simplecpp {
         std::list<std::string> includePaths;
         std::list<std::string> includes;
         std::string std;
-        bool clearIncludeCache{};
+        bool clearIncludeCache{}; /** forget the #include resolutions of earlier runs, for when files were added or removed */
         bool removeComments{}; /** remove comment tokens from included files */
     };
 
+    /**
+     * Index of the preprocessor directives in a token list, built once and
+     * never modified. Inactive #if groups are skipped by jumping straight
+     * from one directive to the next instead of walking the tokens.
+     */
+    class SIMPLECPP_LIB DirectiveIndex {
+    public:
+        DirectiveIndex() = default;
+        explicit DirectiveIndex(const TokenList &tokens);
+
+        /**
+         * Where to continue after the directive starting with hashtok in a
+         * skipped region: the matching #elif/#else/#endif of a conditional,
+         * otherwise the following directive (nullptr at the end of the file).
+         */
+        const Token *skip(const Token *hashtok) const;
+
+        /** An #if or #elif expression, compiled when the index is built */
+        struct Condition;
+
+        /**
+         * The compiled expression of the #if or #elif starting with hashtok,
+         * nullptr if it is not such a directive or its expression must be
+         * preprocessed and evaluated as tokens.
+         */
+        const Condition *condition(const Token *hashtok) const;
+
+    private:
+        static constexpr std::size_t NO_BRANCH = ~static_cast<std::size_t>(0);
+
+        struct Directive {
+            const Token *hashtok;
+            std::size_t nextBranch;
+            std::shared_ptr<const Condition> condition;
+        };
+
+        std::vector<Directive> mDirectives;
+        std::unordered_map<const Token *, std::size_t> mPositions;
+    };
+
     struct SIMPLECPP_LIB FileData {
+        FileData(std::string filename, TokenList tokens);
+        FileData(const FileData &other);
+        FileData(FileData &&other) = default;
+
+        FileData &operator=(const FileData &) = delete;
+        FileData &operator=(FileData &&) = default;
+
         /** The canonical filename associated with this data */
         std::string filename;
         /** The tokens associated with this file */
         TokenList tokens;
+        /**
+         * The controlling macro when the whole file is wrapped in
+         * "#ifndef GUARD ... #endif", empty otherwise. While GUARD is
+         * defined an #include of this file produces nothing and is skipped.
+         */
+        Atom includeGuard;
+        /** The directives in tokens */
+        DirectiveIndex directives;
     };
 
     class SIMPLECPP_LIB FileDataCache {
@@ -460,24 +704,62 @@ namespace simplecpp {
         FileDataCache &operator=(const FileDataCache &) = delete;
         FileDataCache &operator=(FileDataCache &&) = default;
 
-        /** Get the cached data for a file, or load and then return it if it isn't cached.
-         *  returns the file data and true if the file was loaded, false if it was cached. */
-        std::pair<FileData *, bool> get(const std::string &sourcefile, const std::string &header, const DUI &dui, bool systemheader, std::vector<std::string> &filenames, OutputList *outputList);
+        /**
+         * Create a cache that can be shared by concurrent preprocess() calls.
+         * get() and insert() are synchronized, every file is loaded once and
+         * its FileData is never modified afterwards. The file indexes in its
+         * token locations refer to a process-wide table that TokenList::file()
+         * resolves; preprocess() maps them into the caller's files before it
+         * returns. All users of a shared cache should use the same
+         * DUI::removeComments setting.
+         */
+        static FileDataCache concurrent();
 
-        void insert(FileData data) {
-            // NOLINTNEXTLINE(misc-const-correctness) - FP
-            auto *const newdata = new FileData(std::move(data));
+        bool isConcurrent() const {
+            return mShared != nullptr;
+        }
+
+        /**
+         * Keep the lexed files in the given existing directory, so later
+         * runs memory map them instead of lexing the files again. An entry
+         * is used only while the canonical path, size, modification time
+         * and contents of its file match. An empty string disables it.
+         */
+        void setPersistentDirectory(std::string dir) {
+            mPersistentDir = std::move(dir);
+        }
+
+        const std::string &persistentDirectory() const {
+            return mPersistentDir;
+        }
 
-            mData.emplace_back(newdata);
-            mNameMap.emplace(newdata->filename, newdata);
+        /**
+         * Number of worker threads simplecpp::load() and simplecpp::preprocess()
+         * use. With more than one, the headers found by their include walk are
+         * resolved and lexed by the workers ahead of the walk, which still
+         * fills the cache on the calling thread in the same order. 0 or 1
+         * loads one header at a time on the calling thread.
+         */
+        void setLoadThreads(unsigned int threads) {
+            mLoadThreads = threads;
         }
 
-        void clear() {
-            mNameMap.clear();
-            mIdMap.clear();
-            mData.clear();
+        unsigned int loadThreads() const {
+            return mLoadThreads;
         }
 
+        /** Worker threads lexing headers ahead of a parallel include walk */
+        class Prefetcher;
+
+        /** Get the cached data for a file, or load and then return it if it isn't cached.
+         *  filesIndex, if given, indexes filenames.
+         *  returns the file data and true if the file was loaded, false if it was cached. */
+        std::pair<FileData *, bool> get(const std::string &sourcefile, const std::string &header, const DUI &dui, bool systemheader, std::vector<std::string> &filenames, OutputList *outputList, FileIndex *filesIndex = nullptr);
+
+        void insert(FileData data);
+
+        void clear();
+
         using container_type = std::vector<std::unique_ptr<FileData>>;
         using iterator = container_type::iterator;
         using const_iterator = container_type::const_iterator;
@@ -544,13 +826,24 @@ namespace simplecpp {
         using name_map_type = std::unordered_map<std::string, FileData *>;
         using id_map_type = std::unordered_map<FileID, FileData *, FileID::Hasher>;
 
-        static bool getFileId(const std::string &path, FileID &id);
+        bool hasInsertedFiles() const;
 
-        std::pair<FileData *, bool> tryload(name_map_type::iterator &name_it, const DUI &dui, std::vector<std::string> &filenames, OutputList *outputList);
+        std::pair<FileData *, bool> get(const std::string &sourcefile, const std::string &header, const DUI &dui, bool systemheader, std::vector<std::string> &filenames, OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher);
+        std::pair<FileData *, bool> lookup(const std::string &path, const DUI &dui, std::vector<std::string> &filenames, OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher);
+        std::pair<FileData *, bool> tryload(name_map_type::iterator &name_it, const DUI &dui, std::vector<std::string> &filenames, OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher);
+        std::pair<FileData *, bool> tryloadShared(const std::string &path, const DUI &dui, std::vector<std::string> &filenames, OutputList *outputList, FileIndex *filesIndex, Prefetcher *prefetcher);
+
+        /** synchronization state of a concurrent cache */
+        struct Shared;
 
         container_type mData;
         name_map_type mNameMap;
         id_map_type mIdMap;
+        std::shared_ptr<Shared> mShared;
+        std::string mPersistentDir;
+        unsigned int mLoadThreads{};
+        /** insert() was used; relative #includes are then not resolved through the shared resolution cache */
+        bool mHasInsertedFiles{};
     };
 
     /** Converts character literal (including prefix, but not ud-suffix) to long long value.
@@ -604,6 +897,96 @@ namespace simplecpp {
      */
     SIMPLECPP_LIB void cleanup(FileDataCache &cache);
 
+    /**
+     * Snapshot of the preprocessor after the DUI defines and DUI::includes
+     * files, similar to a precompiled header: the macros, the #pragma once
+     * files and the tokens, messages and #if conditions of the -include
+     * files. Translation units with the same prefix resume from it instead
+     * of processing the prefix again. A prefix is never modified after it
+     * is created, so concurrent preprocess() calls can share it. Its
+     * locations use the file indexes of FileDataCache::concurrent(), which
+     * preprocess() maps to the caller's files.
+     */
+    class SIMPLECPP_LIB Prefix {
+    public:
+        /**
+         * Preprocess the defines and -include files of dui. On errors the
+         * prefix is not valid and preprocess() processes dui itself.
+         */
+        Prefix(std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList = nullptr);
+        ~Prefix();
+
+        Prefix(const Prefix &) = delete;
+        Prefix &operator=(const Prefix &) = delete;
+
+        bool valid() const {
+            return mState != nullptr;
+        }
+
+    private:
+        friend SIMPLECPP_LIB void preprocess(TokenList &output, const TokenList &rawtokens, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList, std::list<MacroUsage> *macroUsage, std::list<IfCond> *ifCond);
+        friend SIMPLECPP_LIB void preprocess(TokenList &output, const TokenList &rawtokens, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, const Prefix &prefix, OutputList *outputList, std::list<MacroUsage> *macroUsage, std::list<IfCond> *ifCond);
+
+        struct State;
+
+        /**
+         * Preprocess rawtokens. resume replaces the defines and -include
+         * files of dui, and the state after them is stored in capture.
+         */
+        static void run(TokenList &output, const TokenList &rawtokens, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList, std::list<MacroUsage> *macroUsage, std::list<IfCond> *ifCond, const State *resume, State *capture);
+
+        std::unique_ptr<State> mState;
+    };
+
+    /**
+     * Preprocess rawtokens, resuming from prefix instead of processing the
+     * defines and -include files again. When prefix is not valid or was
+     * created with other defines, undefines, include paths, -include files
+     * or standard than dui this is the same as preprocess() without it.
+     * The builtin __DATE__ and __TIME__ are those of this call.
+     */
+    SIMPLECPP_LIB void preprocess(TokenList &output, const TokenList &rawtokens, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, const Prefix &prefix, OutputList *outputList = nullptr, std::list<MacroUsage> *macroUsage = nullptr, std::list<IfCond> *ifCond = nullptr);
+
+    /**
+     * The state of one preprocessor: the file table that Location::fileIndex
+     * refers to and the cache of loaded files. A context is used by one
+     * thread at a time. Separate contexts can run concurrently and may share
+     * a FileDataCache::concurrent() cache. Interned strings and the token
+     * allocator are safe to share and stay process-wide.
+     */
+    class SIMPLECPP_LIB Context {
+    public:
+        Context();
+        /** Use a cache that may be shared with other contexts */
+        explicit Context(std::shared_ptr<FileDataCache> cache);
+
+        // token lists refer to the file table of their context
+        Context(const Context &) = delete;
+        Context &operator=(const Context &) = delete;
+
+        const std::vector<std::string> &files() const {
+            return mFiles;
+        }
+
+        FileDataCache &cache() {
+            return *mCache;
+        }
+
+        TokenList tokenize(const std::string &filename, OutputList *outputList = nullptr, TokenList::FileInput input = TokenList::FileInput::Mapped);
+        TokenList tokenize(std::istream &istr, const std::string &filename, OutputList *outputList = nullptr);
+
+        /** Load the files included by rawtokens into the cache, see simplecpp::load() */
+        void load(const TokenList &rawtokens, const DUI &dui, OutputList *outputList = nullptr);
+
+        /** Preprocess rawtokens, see simplecpp::preprocess() */
+        TokenList preprocess(const TokenList &rawtokens, const DUI &dui, OutputList *outputList = nullptr, std::list<MacroUsage> *macroUsage = nullptr, std::list<IfCond> *ifCond = nullptr);
+
+    private:
+        std::vector<std::string> mFiles;
+        FileIndex mFileIndex;
+        std::shared_ptr<FileDataCache> mCache;
+    };
+
     /** Simplify path */
     SIMPLECPP_LIB std::string simplifyPath(std::string path);
 
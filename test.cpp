@@ -10,11 +10,14 @@
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <fstream>
 #include <iostream>
 #include <list>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -563,6 +566,11 @@ static void constFold()
     ASSERT_EQUALS("1", testConstFold("010==8"));
     ASSERT_EQUALS("exception", testConstFold("!1 ? 2 :"));
     ASSERT_EQUALS("exception", testConstFold("?2:3"));
+    ASSERT_EQUALS("1", testConstFold("!!1"));
+    ASSERT_EQUALS("1", testConstFold("- -1"));
+    ASSERT_EQUALS("0", testConstFold("0==0<2"));
+    ASSERT_EQUALS("1", testConstFold("1||0&&0"));
+    ASSERT_EQUALS("2", testConstFold("1?2:0?3:4"));
 }
 
 #ifdef __CYGWIN__
@@ -1187,6 +1195,16 @@ static void define_va_args_4() // cppcheck trac #9754
     ASSERT_EQUALS("\nprintf ( 1 , 2 )", preprocess(code));
 }
 
+static void define_va_args_5()
+{
+    // parameters used several times, stringified and pasted in one replacement list
+    const char code[] = "#define A(x, ...) x #x x##1 #__VA_ARGS__ f(x, ##__VA_ARGS__)\n"
+                        "A(a b, c  d)\n"
+                        "A(e)\n";
+    ASSERT_EQUALS("\na b \"a b\" a b1 \"c d\" f ( a b , c d )\n"
+                  "e \"e\" e1 \"\" f ( e )", preprocess(code));
+}
+
 static void define_va_opt_1()
 {
     const char code[] = "#define p1(fmt, args...) printf(fmt __VA_OPT__(,) args)\n"
@@ -2251,6 +2269,22 @@ static void ifdiv0()
     ASSERT_EQUALS("", preprocess(code));
 }
 
+static void ifexpr2()
+{
+    const char code[] = "#define GNUC_PREREQ(x, y) (12 > (x) || 12 == (x) && 2 >= (y))\n"
+                        "#if GNUC_PREREQ(4, 8) && -010 == -8 && 0X10 == 16 && 1 ? 2 : 0 ? 0 : 0\n"
+                        "1\n"
+                        "#endif\n";
+    ASSERT_EQUALS("\n\n1", preprocess(code));
+
+    // all operands are evaluated
+    const char code2[] = "#if 0 && 1 % 0\n"
+                         "#endif\n";
+    simplecpp::OutputList outputList;
+    ASSERT_EQUALS("", preprocess(code2, &outputList));
+    ASSERT_EQUALS("file0,1,syntax_error,failed to evaluate #if condition, division/modulo by zero\n", toString(outputList));
+}
+
 static void ifalt()   // using "and", "or", etc
 {
     const char *code;
@@ -2537,6 +2571,450 @@ static void circularInclude()
     ASSERT_EQUALS("", toString(outputList));
 }
 
+static void includeGuard()
+{
+    std::vector<std::string> files;
+    const auto guardOf = [&files](const char code[]) {
+        return simplecpp::FileData("test.h", makeTokenList(code, files, "test.h")).includeGuard.str();
+    };
+    ASSERT_EQUALS("TEST_H", guardOf("// comment\n#ifndef TEST_H\n#define TEST_H\n#if A\n#else\n#endif\n#endif // TEST_H\n/* comment */\n"));
+    ASSERT_EQUALS("", guardOf("#ifndef TEST_H\n#define TEST_H\n#endif\nint x;\n"));
+    ASSERT_EQUALS("", guardOf("int x;\n#ifndef TEST_H\n#define TEST_H\n#endif\n"));
+    ASSERT_EQUALS("", guardOf("#ifndef TEST_H\n#define TEST_H\n#else\n#endif\n"));
+    ASSERT_EQUALS("", guardOf("#ifndef TEST_H\n#define TEST_H\n#if\n#endif\n#endif\n"));
+    ASSERT_EQUALS("", guardOf("#ifndef TEST_H\n#define TEST_H\n#endif\n#endif\n"));
+    ASSERT_EQUALS("", guardOf("#if !defined(TEST_H)\n#define TEST_H\n#endif\n"));
+
+    const char code_h[] = "#ifndef TEST_H\n"
+                          "#define TEST_H\n"
+                          "x\n"
+                          "#endif\n";
+    const char code_c[] = "#include \"test.h\"\n"
+                          "#include \"test.h\"\n"
+                          "#undef TEST_H\n"
+                          "#include \"test.h\"\n";
+    simplecpp::FileDataCache cache;
+    cache.insert({"test.h", makeTokenList(code_h, files, "test.h")});
+    const simplecpp::TokenList rawtokens = makeTokenList(code_c, files, "test.c");
+
+    simplecpp::OutputList outputList;
+    simplecpp::TokenList tokens2(files);
+    simplecpp::DUI dui;
+    dui.includePaths.emplace_back(".");
+    simplecpp::preprocess(tokens2, rawtokens, files, cache, dui, &outputList);
+    ASSERT_EQUALS("", toString(outputList));
+    ASSERT_EQUALS("\n\nx x", tokens2.stringify());
+}
+
+static void directiveIndex()
+{
+    const char code[] = "#if A\n"      // 1
+                        "#if B\n"      // 2
+                        "x\n"
+                        "#endif\n"     // 4
+                        "#elif C\n"    // 5
+                        "#define D\n"  // 6
+                        "#else\n"      // 7
+                        "#endif\n"     // 8
+                        "y\n";
+    std::vector<std::string> files;
+    const simplecpp::TokenList tokens = makeTokenList(code, files);
+    const simplecpp::DirectiveIndex directives(tokens);
+    const auto skipLine = [&](unsigned int line) -> unsigned int {
+        for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next) {
+            if (tok->op == '#' && tok->location.line == line) {
+                const simplecpp::Token * const next = directives.skip(tok);
+                return next ? next->location.line : 0;
+            }
+        }
+        return ~0U;
+    };
+    ASSERT_EQUALS(5U, skipLine(1));
+    ASSERT_EQUALS(4U, skipLine(2));
+    ASSERT_EQUALS(5U, skipLine(4));
+    ASSERT_EQUALS(7U, skipLine(5));
+    ASSERT_EQUALS(7U, skipLine(6));
+    ASSERT_EQUALS(8U, skipLine(7));
+    ASSERT_EQUALS(0U, skipLine(8));
+}
+
+static std::string preprocessFile(const std::string &filename, simplecpp::FileDataCache &cache)
+{
+    std::vector<std::string> files;
+    simplecpp::OutputList outputList;
+    const simplecpp::TokenList rawtokens(filename, files, &outputList);
+    simplecpp::TokenList tokens2(files);
+    simplecpp::DUI dui;
+    dui.includePaths.emplace_back(testSourceDir);
+    simplecpp::preprocess(tokens2, rawtokens, files, cache, dui, &outputList);
+
+    // the locations must refer to this call's files
+    const auto filename2 = [&files](const simplecpp::Location &loc) {
+        return loc.fileIndex < files.size() ? files[loc.fileIndex] : std::string("?");
+    };
+    std::string ret = tokens2.stringify();
+    for (const simplecpp::Token *tok = tokens2.cfront(); tok; tok = tok->next) {
+        if (!tok->previous || tok->previous->location.fileIndex != tok->location.fileIndex)
+            ret += '\n' + filename2(tok->location);
+    }
+    for (const simplecpp::Output &output : outputList)
+        ret += '\n' + filename2(output.location) + ',' + std::to_string(output.location.line) + ',' + output.msg;
+    return ret;
+}
+
+static void concurrentFileDataCache()
+{
+    const std::string dir = testSourceDir + "/testsuite/clang-preprocessor-tests/";
+    const std::vector<std::string> filenames = {
+        testSourceDir + "/main.cpp",
+        testSourceDir + "/simplecpp.cpp",
+        testSourceDir + "/test.cpp",
+        testSourceDir + "/testsuite/realFileName1.cpp",
+        dir + "disabled-cond-diags2.c",
+        dir + "function_macro_file.c",
+        dir + "include-directive1.c",
+        dir + "include-directive2.c",
+        dir + "macro_expandloc.c",
+        dir + "mi_opt.c",
+        dir + "mi_opt2.c",
+        dir + "pr2086.c",
+        dir + "print_line_include.c"
+    };
+
+    std::vector<std::string> expected;
+    for (const std::string &filename : filenames) {
+        simplecpp::FileDataCache cache;
+        expected.push_back(preprocessFile(filename, cache));
+    }
+
+    // every thread preprocesses all files, starting at a different one
+    simplecpp::FileDataCache cache = simplecpp::FileDataCache::concurrent();
+    const std::size_t numThreads = 8;
+    std::vector<std::vector<std::string>> actual(numThreads, std::vector<std::string>(filenames.size()));
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (std::size_t i = 0; i < filenames.size(); ++i) {
+                const std::size_t f = (t + i) % filenames.size();
+                actual[t][f] = preprocessFile(filenames[f], cache);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (std::size_t t = 0; t < numThreads; ++t) {
+        for (std::size_t f = 0; f < filenames.size(); ++f)
+            ASSERT_EQUALS(expected[f], actual[t][f]);
+    }
+}
+
+static std::string loadFiles(simplecpp::FileDataCache cache)
+{
+    std::vector<std::string> files;
+    std::istringstream istr("#include \"simplecpp.h\"\n"
+                            "#include \"file_to_include.h\"\n"
+                            "#include <missing.h>\n"
+                            "#include \"testsuite/realFileName1.cpp\"\n");
+    const simplecpp::TokenList rawtokens(istr, files, testSourceDir + "/test.c");
+    simplecpp::DUI dui;
+    dui.includePaths.emplace_back(testSourceDir);
+    dui.includePaths.emplace_back(testSourceDir + "/testsuite/clang-preprocessor-tests");
+    dui.includes.emplace_back("missing.h");
+    simplecpp::OutputList outputList;
+    cache = simplecpp::load(rawtokens, files, dui, &outputList, std::move(cache));
+
+    std::string ret;
+    for (const std::unique_ptr<simplecpp::FileData> &filedata : cache)
+        ret += filedata->filename + '\n' + filedata->tokens.stringify() + '\n';
+    for (const std::string &file : files)
+        ret += file + '\n';
+    for (const simplecpp::Output &output : outputList)
+        ret += output.msg + '\n';
+    return ret;
+}
+
+static void parallelLoad()
+{
+    // the workers only lex ahead, the cache is filled in the same order
+    for (int concurrent = 0; concurrent < 2; ++concurrent) {
+        const std::string expected = loadFiles(concurrent ? simplecpp::FileDataCache::concurrent() : simplecpp::FileDataCache());
+        ASSERT_EQUALS(true, expected.find("file_to_include.h") != std::string::npos);
+        for (unsigned int threads = 2; threads <= 8; threads *= 2) {
+            simplecpp::FileDataCache cache = concurrent ? simplecpp::FileDataCache::concurrent() : simplecpp::FileDataCache();
+            cache.setLoadThreads(threads);
+            ASSERT_EQUALS(expected, loadFiles(std::move(cache)));
+        }
+    }
+}
+
+#if SIMPLECPP_TOKEN_POOL && defined(SIMPLECPP_TOKEN_POOL_STATS)
+static std::size_t countTokens(const simplecpp::TokenList &tokens)
+{
+    std::size_t count = 0;
+    for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next)
+        ++count;
+    return count;
+}
+
+static void tokensFreedByOtherThread()
+{
+    // tokens lexed by threads that exit and are freed by this thread are reused
+    std::string code;
+    for (int i = 0; i < 1000; ++i)
+        code += "int x" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+
+    const int rounds = 20;
+    std::size_t lexed = 0;
+    const std::size_t before = simplecpp::tokenPoolCapacity();
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<std::string> files;
+        std::unique_ptr<simplecpp::TokenList> tokens;
+        std::thread([&]() {
+            tokens.reset(new simplecpp::TokenList({code.data(), code.size()}, files, "test.c"));
+        }).join();
+        lexed = countTokens(*tokens);
+    }
+    ASSERT_EQUALS(5000U, lexed);
+    // leaking would allocate the tokens of every round
+    ASSERT_EQUALS(true, simplecpp::tokenPoolCapacity() - before < rounds * lexed / 2);
+}
+
+static void repeatedParallelLoad()
+{
+    // the tokens lexed by the workers of each load are reused by the next ones
+    const int rounds = 20;
+    std::size_t loaded = 0;
+    const std::size_t before = simplecpp::tokenPoolCapacity();
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<std::string> files;
+        std::istringstream istr("#include \"simplecpp.h\"\n");
+        const simplecpp::TokenList rawtokens(istr, files, testSourceDir + "/test.c");
+        simplecpp::FileDataCache cache;
+        cache.setLoadThreads(4);
+        cache = simplecpp::load(rawtokens, files, simplecpp::DUI(), nullptr, std::move(cache));
+        ASSERT_EQUALS(1U, cache.size());
+        loaded = countTokens((*cache.begin())->tokens);
+    }
+    ASSERT_EQUALS(true, loaded > 1000U);
+    ASSERT_EQUALS(true, simplecpp::tokenPoolCapacity() - before < rounds * loaded / 2);
+}
+#endif
+
+static void includeResolutionCache()
+{
+    simplecpp::DUI dui;
+    dui.includePaths.emplace_back(testSourceDir + "/testsuite/clang-preprocessor-tests");
+    std::vector<std::string> files;
+
+    // the resolutions, also of missing headers, are shared by all caches
+    for (int i = 0; i < 2; ++i) {
+        simplecpp::FileDataCache cache;
+        const simplecpp::FileData * const found = cache.get("test.c", "file_to_include.h", dui, true, files, nullptr).first;
+        ASSERT_EQUALS(true, found != nullptr);
+        ASSERT_EQUALS(dui.includePaths.front() + "/file_to_include.h", found->filename);
+        ASSERT_EQUALS(true, cache.get("test.c", "missing.h", dui, false, files, nullptr).first == nullptr);
+    }
+
+    // a file inserted into a cache is found although the header is known to be missing on disk
+    simplecpp::FileDataCache cache;
+    cache.insert({"missing.h", simplecpp::TokenList(files)});
+    ASSERT_EQUALS(true, cache.get("test.c", "missing.h", dui, false, files, nullptr).first != nullptr);
+}
+
+static void context()
+{
+    const auto cache = std::make_shared<simplecpp::FileDataCache>(simplecpp::FileDataCache::concurrent());
+    simplecpp::DUI dui;
+    dui.includePaths.emplace_back(testSourceDir + "/testsuite/clang-preprocessor-tests");
+
+    // two contexts with their own file tables that share the loaded header
+    for (int i = 0; i < 2; ++i) {
+        simplecpp::Context ctx(cache);
+        std::istringstream istr(i == 0 ? "#include \"file_to_include.h\"\n" : "#define A 1\nA\n#include \"file_to_include.h\"\n");
+        const simplecpp::TokenList rawtokens = ctx.tokenize(istr, "test.c");
+        simplecpp::OutputList outputList;
+        ctx.load(rawtokens, dui, &outputList);
+        const simplecpp::TokenList out = ctx.preprocess(rawtokens, dui, &outputList);
+        ASSERT_EQUALS(i == 0 ? "" : "\n1", out.stringify());
+        ASSERT_EQUALS("file1,2,#warning,#warning file successfully included\n", toString(outputList));
+        ASSERT_EQUALS(2U, ctx.files().size());
+        ASSERT_EQUALS("test.c", ctx.files()[0]);
+        ASSERT_EQUALS(dui.includePaths.front() + "/file_to_include.h", ctx.files()[1]);
+    }
+    ASSERT_EQUALS(1U, cache->size());
+}
+
+static void fileIndex()
+{
+    std::vector<std::string> files{"a.c"};
+    simplecpp::FileIndex index(files);
+    ASSERT_EQUALS(true, &index.files() == &files);
+    ASSERT_EQUALS(0U, index.get("a.c"));
+    ASSERT_EQUALS(1U, index.get("b.h"));
+    files.emplace_back("c.h"); // appended without the index
+    unsigned int i = 0;
+    ASSERT_EQUALS(true, index.find("c.h", i));
+    ASSERT_EQUALS(2U, i);
+    ASSERT_EQUALS(false, index.find("d.h", i));
+
+    // token lists use the index for #line and linemarkers
+    std::istringstream istr("# 1 \"b.h\"\nx\n#line 3 \"d.h\"\ny\n");
+    const simplecpp::TokenList tokens(istr, files, "c.h", nullptr, &index);
+    ASSERT_EQUALS(true, tokens.getFileIndex() == &index);
+    ASSERT_EQUALS(4U, files.size());
+    ASSERT_EQUALS("d.h", files[3]);
+    ASSERT_EQUALS("x", tokens.cfront()->next->next->next->str());
+    ASSERT_EQUALS(1U, tokens.cfront()->next->next->next->location.fileIndex);
+    ASSERT_EQUALS(3U, tokens.cback()->location.fileIndex);
+
+    // files changed in place to the same size are reindexed
+    files = {"e.h", "a.c", "c.h", "b.h"};
+    ASSERT_EQUALS(true, index.find("b.h", i));
+    ASSERT_EQUALS(3U, i);
+    ASSERT_EQUALS(false, index.find("d.h", i));
+    ASSERT_EQUALS(0U, index.get("e.h"));
+    files.clear();
+    ASSERT_EQUALS(0U, index.get("f.h"));
+
+    // refilled with more files, with and without reallocating
+    for (int reserve = 0; reserve < 2; ++reserve) {
+        std::vector<std::string> refilled;
+        if (reserve)
+            refilled.reserve(16);
+        refilled.insert(refilled.end(), {"a", "b", "c"});
+        simplecpp::FileIndex refilledIndex(refilled);
+        ASSERT_EQUALS(0U, refilledIndex.get("a"));
+        const std::string * const data = refilled.data();
+        refilled.clear();
+        refilled.insert(refilled.end(), {"d", "e", "f", "g", "h"});
+        ASSERT_EQUALS(reserve == 1, refilled.data() == data);
+        ASSERT_EQUALS(1U, refilledIndex.get("e"));
+        ASSERT_EQUALS(5U, refilled.size());
+    }
+}
+
+static void serialize()
+{
+    const char code[] = "#define A(x) x /* c */\n"
+                        "# 5 \"b.h\"\n"
+                        "int  a[] = { 1, 0x2 };\n"
+                        "#line 2 \"a.c\"\n"
+                        "A (\"s\") L'c'";
+    std::vector<std::string> files;
+    const simplecpp::TokenList tokens = makeTokenList(code, files, "a.c");
+    const std::string data = tokens.serialize();
+
+    // the files are added to the other list's files
+    std::vector<std::string> files2{"x.c", "b.h"};
+    simplecpp::TokenList tokens2(files2);
+    ASSERT_EQUALS(true, tokens2.deserialize(data.data(), data.size()));
+    ASSERT_EQUALS(3U, files2.size());
+    ASSERT_EQUALS("a.c", files2[2]);
+
+    const simplecpp::Token *tok2 = tokens2.cfront();
+    for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next, tok2 = tok2->next) {
+        ASSERT_EQUALS(tok->str(), tok2->str());
+        ASSERT_EQUALS(tokens.file(tok->location), tokens2.file(tok2->location));
+        ASSERT_EQUALS(tok->location.line, tok2->location.line);
+        ASSERT_EQUALS(tok->location.col, tok2->location.col);
+        ASSERT_EQUALS(tok->whitespaceahead, tok2->whitespaceahead);
+        ASSERT_EQUALS(tok->op, tok2->op);
+        ASSERT_EQUALS(tok->name, tok2->name);
+        ASSERT_EQUALS(tok->number, tok2->number);
+        ASSERT_EQUALS(tok->comment, tok2->comment);
+    }
+    ASSERT_EQUALS(true, tok2 == nullptr);
+
+    // truncated data is rejected
+    simplecpp::TokenList tokens3(files2);
+    ASSERT_EQUALS(false, tokens3.deserialize(data.data(), data.size() - 1));
+    ASSERT_EQUALS(true, tokens3.empty());
+}
+
+static void prefix()
+{
+    const char prefix_h[] = "#pragma once\n"
+                            "#define B(x) (x + A)\n"
+                            "#warning prefix\n"
+                            "#if A\n"
+                            "int p;\n"
+                            "#endif\n";
+    const char code[] = "#include \"prefix.h\"\n"
+                        "B(2) __FILE__\n";
+
+    std::vector<std::string> files;
+    simplecpp::FileDataCache cache;
+    cache.insert({"prefix.h", makeTokenList(prefix_h, files, "prefix.h")});
+    simplecpp::DUI dui;
+    dui.defines.emplace_back("A=1");
+    dui.includes.emplace_back("prefix.h");
+
+    simplecpp::OutputList outputList;
+    const simplecpp::Prefix prefix(files, cache, dui, &outputList);
+    ASSERT_EQUALS(true, prefix.valid());
+    ASSERT_EQUALS("file0,3,#warning,#warning prefix\n", toString(outputList));
+
+    const auto locations = [](const simplecpp::TokenList &tokens) {
+        std::string ret;
+        for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next)
+            ret += tokens.file(tok->location) + ':' + std::to_string(tok->location.line) + ' ' + tok->str() + '\n';
+        return ret;
+    };
+
+    outputList.clear();
+    const simplecpp::TokenList rawtokens = makeTokenList(code, files, "test.c");
+    simplecpp::TokenList expected(files);
+    simplecpp::preprocess(expected, rawtokens, files, cache, dui, &outputList);
+    ASSERT_EQUALS("prefix.h:5 int\nprefix.h:5 p\nprefix.h:5 ;\n"
+                  "test.c:2 (\ntest.c:2 2\ntest.c:2 +\ntest.c:2 1\ntest.c:2 )\ntest.c:2 \"test.c\"\n", locations(expected));
+    ASSERT_EQUALS("file0,3,#warning,#warning prefix\n", toString(outputList));
+
+    // resumed with another file table the same output is produced
+    std::vector<std::string> files2;
+    const simplecpp::TokenList rawtokens2 = makeTokenList(code, files2, "test.c");
+    simplecpp::OutputList outputList2;
+    simplecpp::TokenList tokens2(files2);
+    simplecpp::preprocess(tokens2, rawtokens2, files2, cache, dui, prefix, &outputList2);
+    ASSERT_EQUALS(locations(expected), locations(tokens2));
+    ASSERT_EQUALS("file1,3,#warning,#warning prefix\n", toString(outputList2));
+    ASSERT_EQUALS("prefix.h", files2[1]);
+
+    // a prefix of other defines is not used
+    simplecpp::DUI dui2 = dui;
+    dui2.defines.front() = "A=0";
+    simplecpp::TokenList tokens3(files2);
+    simplecpp::preprocess(tokens3, rawtokens2, files2, cache, dui2, prefix);
+    ASSERT_EQUALS("test.c:2 (\ntest.c:2 2\ntest.c:2 +\ntest.c:2 0\ntest.c:2 )\ntest.c:2 \"test.c\"\n", locations(tokens3));
+}
+
+static void prefixDateTime()
+{
+    // the builtin __DATE__ and __TIME__ are renewed when the prefix is resumed, the user's are kept
+    const char prefix_h[] = "#undef __DATE__\n"
+                            "#define __DATE__ \"d\"\n";
+    std::vector<std::string> files;
+    simplecpp::FileDataCache cache;
+    cache.insert({"prefix.h", makeTokenList(prefix_h, files, "prefix.h")});
+    simplecpp::DUI dui;
+    dui.includes.emplace_back("prefix.h");
+    const simplecpp::Prefix prefix(files, cache, dui);
+    ASSERT_EQUALS(true, prefix.valid());
+
+    std::vector<std::string> files2;
+    const simplecpp::TokenList rawtokens = makeTokenList("__DATE__ __TIME__", files2, "test.c");
+    simplecpp::TokenList tokens(files2);
+    simplecpp::preprocess(tokens, rawtokens, files2, cache, dui, prefix);
+    ASSERT_EQUALS("\"d\"", tokens.cfront()->str());
+    ASSERT_EQUALS(10U, tokens.cback()->str().size()); // "hh:mm:ss"
+
+    dui.defines.emplace_back("__TIME__=\"t\"");
+    const simplecpp::Prefix prefix2(files, cache, dui);
+    simplecpp::TokenList tokens2(files2);
+    simplecpp::preprocess(tokens2, rawtokens, files2, cache, dui, prefix2);
+    ASSERT_EQUALS("\"d\" \"t\"", tokens2.stringify());
+}
+
 static void multiline1()
 {
     const char code[] = "#define A \\\n"
@@ -3013,6 +3491,21 @@ static void readfile_file_not_found()
     ASSERT_EQUALS("file0,0,file_not_found,File is missing: NotAFile\n", toString(outputList));
 }
 
+static void readfile_file_input()
+{
+    const std::string filename = testSourceDir + "/simplecpp.h";
+    std::vector<std::string> files;
+    const simplecpp::TokenList mapped(filename, files, nullptr, simplecpp::TokenList::FileInput::Mapped);
+    const simplecpp::TokenList stdio(filename, files, nullptr, simplecpp::TokenList::FileInput::Stdio);
+    ASSERT_EQUALS(1, files.size());
+    ASSERT_EQUALS(false, mapped.empty());
+    ASSERT_EQUALS(stdio.stringify(), mapped.stringify());
+
+    simplecpp::OutputList outputList;
+    (void)simplecpp::TokenList("NotAFile", files, &outputList, simplecpp::TokenList::FileInput::Stdio);
+    ASSERT_EQUALS("file0,0,file_not_found,File is missing: NotAFile\n", toString(outputList));
+}
+
 static void stringify1()
 {
     const char code_c[] = "#include \"A.h\"\n"
@@ -3218,6 +3711,11 @@ static void unicode_invalid()
         const char code[] = "\xFF\xFE\x31\x00\x32\x00\x33";
         ASSERT_EQUALS("123", readfile(code, sizeof(code)));
     }
+    {
+        // converted input must not be taken for another BOM
+        const char code[] = "\xFF\xFE\xFF\xFE\xFF\xFE\x31\x00";
+        ASSERT_EQUALS("", readfile(code, sizeof(code)));
+    }
 }
 
 static void warning()
@@ -3539,6 +4037,36 @@ static void token()
     ASSERT_TOKEN("+22", false, true, false);
 }
 
+static void atom()
+{
+    const simplecpp::Atom empty;
+    ASSERT_EQUALS(true, empty.empty());
+    ASSERT_EQUALS(true, empty == simplecpp::Atom(""));
+
+    const simplecpp::Atom a("name");
+    ASSERT_EQUALS("name", a.str());
+    ASSERT_EQUALS(true, a == simplecpp::Atom(std::string("na") + "me"));
+    ASSERT_EQUALS(true, a != simplecpp::Atom("name2"));
+    ASSERT_EQUALS(true, a == std::string("name"));
+    ASSERT_EQUALS(simplecpp::Atom("name").hash(), a.hash());
+
+    // long strings are not interned but still compare by value
+    const std::string longstr(100, 'x');
+    const simplecpp::Atom l1(longstr);
+    simplecpp::Atom l2(longstr);
+    ASSERT_EQUALS(true, l1 == l2);
+    ASSERT_EQUALS(true, l1 != a);
+    l2 = a;
+    ASSERT_EQUALS(true, l2 == a);
+    ASSERT_EQUALS(longstr, l1.str());
+
+    simplecpp::Token tok(a, simplecpp::Location());
+    ASSERT_EQUALS(true, tok.name);
+    tok.setstr("1");
+    ASSERT_EQUALS(true, tok.number);
+    ASSERT_EQUALS(true, tok.atom() == simplecpp::Atom("1"));
+}
+
 static void preprocess_files()
 {
     {
@@ -3738,6 +4266,22 @@ static void ifCond()
         ASSERT_EQUALS("0", it->E);
         ASSERT_EQUALS(0, it->result);
     }
+    {
+        const char code[] = "#define A 2\n"
+                            "#define B x\n"
+                            "#if defined A && defined(C) || A == 2\n"
+                            "#elif B == 0\n"
+                            "#endif\n";
+        std::list<simplecpp::IfCond> ifCond;
+        ASSERT_EQUALS("", preprocess(code, &ifCond));
+        ASSERT_EQUALS(2, ifCond.size());
+        auto it = ifCond.cbegin();
+        ASSERT_EQUALS("1 && 0 || 2 == 2", it->E);
+        ASSERT_EQUALS(1, it->result);
+        ++it;
+        ASSERT_EQUALS("x == 0", it->E);
+        ASSERT_EQUALS(1, it->result);
+    }
 }
 
 static void macroUsage()
@@ -3765,6 +4309,22 @@ static void macroUsage()
         ASSERT_EQUALS(2, it->useLocation.line);
         ASSERT_EQUALS(8, it->useLocation.col);
     }
+    {
+        const char code[] = "#define A 2\n"
+                            "#if A + A > 3\n"
+                            "#endif\n";
+        std::list<simplecpp::MacroUsage> macroUsage;
+        ASSERT_EQUALS("", preprocess(code, &macroUsage));
+        ASSERT_EQUALS(4, macroUsage.size());
+        auto it = macroUsage.cbegin();
+        ASSERT_EQUALS("A", it->macroName);
+        ASSERT_EQUALS(2, it->useLocation.line);
+        ASSERT_EQUALS(5, it->useLocation.col);
+        ++it;
+        ASSERT_EQUALS("A", it->macroName);
+        ASSERT_EQUALS(2, it->useLocation.line);
+        ASSERT_EQUALS(9, it->useLocation.col);
+    }
 }
 
 static void isAbsolutePath() {
@@ -3910,6 +4470,7 @@ static void runTests(int argc, char **argv, Input input)
     TEST_CASE(define_va_args_2);
     TEST_CASE(define_va_args_3);
     TEST_CASE(define_va_args_4);
+    TEST_CASE(define_va_args_5);
     TEST_CASE(define_va_opt_1);
     TEST_CASE(define_va_opt_2);
     TEST_CASE(define_va_opt_3);
@@ -4006,6 +4567,7 @@ static void runTests(int argc, char **argv, Input input)
     TEST_CASE(ifif);
     TEST_CASE(ifoverflow);
     TEST_CASE(ifdiv0);
+    TEST_CASE(ifexpr2);
     TEST_CASE(ifalt); // using "and", "or", etc
     TEST_CASE(ifexpr);
     TEST_CASE(ifUndefFuncStyleMacro);
@@ -4029,6 +4591,20 @@ static void runTests(int argc, char **argv, Input input)
     TEST_CASE(nestedInclude);
     TEST_CASE(systemInclude);
     TEST_CASE(circularInclude);
+    TEST_CASE(includeGuard);
+    TEST_CASE(directiveIndex);
+    TEST_CASE(concurrentFileDataCache);
+    TEST_CASE(parallelLoad);
+#if SIMPLECPP_TOKEN_POOL && defined(SIMPLECPP_TOKEN_POOL_STATS)
+    TEST_CASE(tokensFreedByOtherThread);
+    TEST_CASE(repeatedParallelLoad);
+#endif
+    TEST_CASE(includeResolutionCache);
+    TEST_CASE(context);
+    TEST_CASE(fileIndex);
+    TEST_CASE(serialize);
+    TEST_CASE(prefix);
+    TEST_CASE(prefixDateTime);
 
     TEST_CASE(nullDirective1);
     TEST_CASE(nullDirective2);
@@ -4064,6 +4640,7 @@ static void runTests(int argc, char **argv, Input input)
     TEST_CASE(readfile_unhandled_chars);
     TEST_CASE(readfile_error);
     TEST_CASE(readfile_file_not_found);
+    TEST_CASE(readfile_file_input);
 
     TEST_CASE(stringify1);
 
@@ -4102,6 +4679,7 @@ static void runTests(int argc, char **argv, Input input)
     TEST_CASE(stdValid);
 
     TEST_CASE(token);
+    TEST_CASE(atom);
 
     TEST_CASE(preprocess_files);
 